@@ -0,0 +1,572 @@
+/*
+ * Copyright (c) 2018-2019 Bryan Cain
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Runs conversions on a pool of worker threads and reports the results through a message queue. Also finds the
+// input files in a directory tree for the CLI and the GUI.
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include "palapply.h"
+#include "batch.h"
+#include "cache.h"
+
+typedef struct {
+    gchar *inputPath;
+    gchar *outputPath;
+    bool writeOutput; // false if the user chose not to overwrite an existing output file
+    bool writeMask;   // false if the user chose not to overwrite an existing mask file
+    gchar *error;     // why the job failed, if it did
+    long bytesSaved;  // how much the optimizer saved, in optimize mode
+    guint64 cost;     // rough amount of work, for scheduling; see estimateCost()
+    guint sequence;   // order in which the job was pushed
+    bool upToDate;    // skipped because the cache said the outputs were current
+    ConversionStats *stats; // filled in by the conversion if the batch is collecting statistics
+} BatchJob;
+
+struct Batch {
+    const Palette *palette;
+    ConvertOptions options;
+    GThreadPool *pool;
+    GAsyncQueue *messages;
+    ConversionCache *cache; // NULL unless batchUseCache() was called
+    BatchNotifyFunc notify; // NULL unless batchSetNotify() was called
+    gpointer notifyData;
+    SDL_atomic_t cancelled; // also the conversions' cancellation flag, so batchCancel() stops them between rows
+    SDL_atomic_t spareThreads; // CPUs that no worker is converting on, which conversions borrow for helper threads
+    SDL_atomic_t unfinished;   // jobs pushed but not yet finished
+    int numThreads;
+    guint numPushed;
+    bool collectStats;
+    GHashTable *outputs; // outputKey() of every output and mask path pushed so far -> input path that writes it
+};
+
+// takes ownership of message
+static void postMessage(Batch *batch, BatchMessage *message)
+{
+    g_async_queue_push(batch->messages, message);
+    if (batch->notify)
+    {
+        batch->notify(batch->notifyData);
+    }
+}
+
+static void postLog(Batch *batch, const gchar *format, ...)
+{
+    va_list args;
+    BatchMessage *message = g_new0(BatchMessage, 1);
+    message->type = BATCH_MESSAGE_LOG;
+    message->ok = true;
+    va_start(args, format);
+    message->text = g_strdup_vprintf(format, args);
+    va_end(args);
+    postMessage(batch, message);
+}
+
+// makes a mask filename by replacing the ".png" extension of the output path with "-mask.png"
+gchar *maskPathForOutput(const gchar *outputPath)
+{
+    size_t outputPathLength = strlen(outputPath);
+    return g_strdup_printf("%.*s-mask.png", (int)(outputPathLength - 4), outputPath);
+}
+
+// Makes the path that the result for an input goes to, by replacing the extension of its path relative to the input
+// directory with ".png" and putting it under the output directory. Creates any subdirectories that it needs.
+gchar *outputPathForInput(const gchar *outputDirPath, const gchar *relativePath)
+{
+    const gchar *baseName = strrchr(relativePath, '/');
+    const gchar *extension = strrchr(baseName ? baseName : relativePath, '.');
+    int stemLength = extension ? (int)(extension - relativePath) : (int) strlen(relativePath);
+    gchar *outputPath = g_strdup_printf("%s/%.*s.png", outputDirPath, stemLength, relativePath);
+
+    gchar *parentPath = g_path_get_dirname(outputPath);
+    g_mkdir_with_parents(parentPath, 0755);
+    g_free(parentPath);
+
+    return outputPath;
+}
+
+static bool runJob(Batch *batch, BatchJob *job)
+{
+    ConvertOptions options = batch->options;
+    ConvertResult result;
+    gchar *maskPath = maskPathForOutput(job->outputPath);
+    options.writeImage = options.writeImage && job->writeOutput;
+    options.writeMask = options.writeMask && job->writeMask;
+    options.cancel = &batch->cancelled;
+    options.spareThreads = &batch->spareThreads;
+    if (batch->collectStats)
+    {
+        job->stats = g_new0(ConversionStats, 1);
+        options.stats = job->stats;
+    }
+
+    gchar *key = batch->cache ? conversionCacheKey(job->inputPath, batch->palette, &batch->options) : NULL;
+    if (key && conversionCacheIsCurrent(batch->cache, job->outputPath, maskPath, key))
+    {
+        postLog(batch, "Up to date %s\n", job->outputPath);
+        job->upToDate = true;
+        g_free(job->stats);
+        job->stats = NULL;
+        g_free(key);
+        g_free(maskPath);
+        return true;
+    }
+
+    bool ok = convertImageFile(job->inputPath, batch->palette, &options, job->outputPath, maskPath, &result);
+
+    if (result.canceled)
+    {
+        postLog(batch, "Canceled %s\n", job->inputPath);
+        job->error = g_strdup("canceled");
+        g_free(key);
+        g_free(maskPath);
+        return false;
+    }
+    else if (!result.sourceRead)
+    {
+        postLog(batch, "\nFailed to read image %s\n", job->inputPath);
+        job->error = g_strdup_printf("failed to read image: %s", SDL_GetError());
+        g_free(key);
+        g_free(maskPath);
+        return false;
+    }
+    else if (!ok)
+    {
+        bool imageFailed = options.writeImage && !result.imageWritten;
+        const gchar *failedPath = imageFailed ? job->outputPath : maskPath;
+        if (result.imageWritten)
+        {
+            postLog(batch, "Saved image %s\n", job->outputPath);
+        }
+        postLog(batch, "\nFailed to save %s %s\n", imageFailed ? "image" : "alpha mask", failedPath);
+        job->error = g_strdup(result.error);
+        g_free(key);
+        g_free(maskPath);
+        return false;
+    }
+
+    // only a complete set of outputs goes in the cache, so skipped files get another chance next time
+    if (key && result.imageWritten && (result.maskWritten || !result.maskNeeded))
+    {
+        conversionCacheStore(batch->cache, job->outputPath, maskPath, key, result.maskWritten);
+    }
+
+    if (options.writeImage)
+    {
+        postLog(batch, "Saved image %s\n", job->outputPath);
+    }
+    else
+    {
+        postLog(batch, "Not overwriting %s\n", job->outputPath);
+    }
+    if (options.optimize)
+    {
+        job->bytesSaved = result.bytesSaved;
+    }
+
+    if (result.maskWritten)
+    {
+        postLog(batch, "Saved alpha mask %s\n", maskPath);
+    }
+    else if (result.maskNeeded)
+    {
+        postLog(batch, "Not overwriting %s\n", maskPath);
+    }
+
+    g_free(key);
+    g_free(maskPath);
+    return true;
+}
+
+static void workerMain(gpointer data, gpointer userData)
+{
+    BatchJob *job = (BatchJob*) data;
+    Batch *batch = (Batch*) userData;
+
+    BatchMessage *message = g_new0(BatchMessage, 1);
+    gint64 startTime = g_get_monotonic_time();
+
+    // jobs that were still queued when the batch was canceled are dropped without touching any files
+    message->type = BATCH_MESSAGE_FILE_DONE;
+    message->ok = !SDL_AtomicGet(&batch->cancelled) && runJob(batch, job);
+
+    // this thread's CPU is only spare if there's no queued job left for it to take next
+    if (SDL_AtomicAdd(&batch->unfinished, -1) <= batch->numThreads)
+    {
+        SDL_AtomicAdd(&batch->spareThreads, 1);
+    }
+    message->elapsed = g_get_monotonic_time() - startTime;
+    message->text = job->error;
+    message->inputPath = job->inputPath;
+    message->bytesSaved = job->bytesSaved;
+    message->upToDate = job->upToDate;
+    message->stats = job->stats;
+    postMessage(batch, message);
+
+    g_free(job->outputPath);
+    g_free(job);
+}
+
+typedef struct {
+    GDir *dir;
+    gchar *path;
+    gchar *relativePath; // NULL for the top directory
+    int depth;           // 0 for the top directory
+} ScanDirectory;
+
+struct BatchScan {
+    gchar **extensions;  // NULL to take every file
+    int maxDepth;        // negative for no limit
+    GArray *stack;       // ScanDirectory entries for the directories being read, innermost last
+    GHashTable *skipped; // paths passed to batchScanSkip()
+};
+
+// Splits a comma-separated list such as "png, .GIF,bmp" into lowercase extensions without the leading dot.
+gchar **parseExtensionList(const gchar *list)
+{
+    gchar **extensions = g_strsplit(list, ",", -1);
+    int count = 0;
+
+    for (int i = 0; extensions[i]; i++)
+    {
+        gchar *extension = g_strstrip(extensions[i]);
+        if (*extension == '.') extension++;
+        gchar *lowercase = (*extension != '\0') ? g_ascii_strdown(extension, -1) : NULL;
+
+        g_free(extensions[i]);
+        if (lowercase) extensions[count++] = lowercase;
+    }
+    extensions[count] = NULL;
+    return extensions;
+}
+
+static bool hasExtension(gchar **extensions, const gchar *name)
+{
+    if (extensions == NULL)
+    {
+        return true;
+    }
+
+    const gchar *extension = strrchr(name, '.');
+    if (extension == NULL)
+    {
+        return false;
+    }
+
+    for (gchar **candidate = extensions; *candidate; candidate++)
+    {
+        if (g_ascii_strcasecmp(extension + 1, *candidate) == 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool scanPushDirectory(BatchScan *scan, const gchar *path, const gchar *relativePath, int depth)
+{
+    ScanDirectory entry;
+    entry.dir = g_dir_open(path, 0, NULL);
+    if (entry.dir == NULL)
+    {
+        return false;
+    }
+    entry.path = g_strdup(path);
+    entry.relativePath = g_strdup(relativePath);
+    entry.depth = depth;
+    g_array_append_val(scan->stack, entry);
+    return true;
+}
+
+static void scanPopDirectory(BatchScan *scan)
+{
+    ScanDirectory *entry = &g_array_index(scan->stack, ScanDirectory, scan->stack->len - 1);
+    g_dir_close(entry->dir);
+    g_free(entry->path);
+    g_free(entry->relativePath);
+    g_array_set_size(scan->stack, scan->stack->len - 1);
+}
+
+// Starts reading a directory. Subdirectories are read down to maxDepth levels below it, or without limit if maxDepth
+// is negative, except for symbolic links to directories, which could lead back up the tree. The scan keeps its own
+// copy of the extensions; NULL takes every file. Returns NULL if the directory can't be opened.
+BatchScan *batchScanNew(const gchar *dirPath, gchar **extensions, int maxDepth)
+{
+    BatchScan *scan = g_new(BatchScan, 1);
+    scan->extensions = g_strdupv(extensions);
+    scan->maxDepth = maxDepth;
+    scan->stack = g_array_new(FALSE, FALSE, sizeof(ScanDirectory));
+    scan->skipped = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+
+    if (!scanPushDirectory(scan, dirPath, NULL, 0))
+    {
+        batchScanFree(scan);
+        return NULL;
+    }
+    return scan;
+}
+
+// Finds the next input file. Returns false once the whole tree has been read; otherwise sets *inputPath and
+// *relativePath, which the caller must free with g_free(). Subdirectories that can't be opened are left out.
+bool batchScanNext(BatchScan *scan, gchar **inputPath, gchar **relativePath)
+{
+    while (scan->stack->len > 0)
+    {
+        ScanDirectory *top = &g_array_index(scan->stack, ScanDirectory, scan->stack->len - 1);
+        const gchar *name = g_dir_read_name(top->dir);
+
+        if (name == NULL)
+        {
+            scanPopDirectory(scan);
+            continue;
+        }
+
+        gchar *path = g_strdup_printf("%s/%s", top->path, name);
+        gchar *relative = top->relativePath ? g_strdup_printf("%s/%s", top->relativePath, name) : g_strdup(name);
+
+        if (g_file_test(path, G_FILE_TEST_IS_DIR))
+        {
+            // pushing may move the array, so top isn't used after this
+            int depth = top->depth + 1;
+            if ((scan->maxDepth < 0 || depth <= scan->maxDepth) && !g_file_test(path, G_FILE_TEST_IS_SYMLINK))
+            {
+                scanPushDirectory(scan, path, relative, depth);
+            }
+        }
+        else if (hasExtension(scan->extensions, name) && !g_hash_table_contains(scan->skipped, path))
+        {
+            *inputPath = path;
+            *relativePath = relative;
+            return true;
+        }
+
+        g_free(path);
+        g_free(relative);
+    }
+    return false;
+}
+
+// Leaves out a file if the scan comes across it later. Used for the results of the files queued so far, so that a
+// scan of a tree that is also the output directory doesn't pick up the files it is writing.
+void batchScanSkip(BatchScan *scan, const gchar *path)
+{
+    g_hash_table_add(scan->skipped, g_strdup(path));
+}
+
+void batchScanFree(BatchScan *scan)
+{
+    while (scan->stack->len > 0)
+    {
+        scanPopDirectory(scan);
+    }
+    g_array_free(scan->stack, TRUE);
+    g_hash_table_destroy(scan->skipped);
+    g_strfreev(scan->extensions);
+    g_free(scan);
+}
+
+// The time a conversion takes is roughly proportional to its number of pixels, which can be read from the file's
+// header without decoding it. Files whose header can't be read are costed by their size in bytes, which is in the
+// same ballpark for the compressed formats this gets.
+static guint64 estimateCost(const gchar *inputPath)
+{
+    int width, height;
+    GStatBuf info;
+
+    if (readImageSize(inputPath, &width, &height))
+    {
+        return (guint64) width * height;
+    }
+    return g_stat(inputPath, &info) == 0 ? (guint64) info.st_size : 0;
+}
+
+// Sort function for the pool's queue. The most expensive jobs go first, so that a few huge images don't end up
+// starting last and leaving every other thread idle while they finish. Equal jobs run in the order they were pushed.
+static gint compareJobs(gconstpointer a, gconstpointer b, gpointer userData)
+{
+    const BatchJob *jobA = (const BatchJob*) a, *jobB = (const BatchJob*) b;
+
+    if (jobA->cost != jobB->cost)
+    {
+        return jobA->cost > jobB->cost ? -1 : 1;
+    }
+    return jobA->sequence < jobB->sequence ? -1 : (jobA->sequence > jobB->sequence);
+}
+
+// Any thread that finishes a job takes the most expensive job left in the queue. The CPUs that no thread is working
+// on are counted in spareThreads, and a conversion that can split up its work (a huge image quantized in bands, or
+// the trial encodings of optimize mode) starts helpers only on those. While the queue is full, every CPU is busy with
+// a job of its own and the conversions run single-threaded; as the queue runs dry, the last few big images pick up
+// the CPUs the idle workers leave behind. numThreads <= 0 means one thread per processor.
+Batch *batchNew(const Palette *palette, const ConvertOptions *options, int numThreads)
+{
+    Batch *batch = g_new0(Batch, 1);
+    batch->palette = palette;
+    batch->options = *options;
+
+    if (numThreads <= 0)
+    {
+        numThreads = g_get_num_processors();
+    }
+    batch->numThreads = numThreads;
+    SDL_AtomicSet(&batch->spareThreads, g_get_num_processors());
+
+    batch->outputs = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    batch->messages = g_async_queue_new();
+    batch->pool = g_thread_pool_new(workerMain, batch, numThreads, FALSE, NULL);
+    g_thread_pool_set_sort_function(batch->pool, compareJobs, NULL);
+    return batch;
+}
+
+// Skips jobs whose outputs the cache says are already up to date, and records the ones that get converted. Call it
+// before pushing any jobs. The cache must stay alive until the batch is freed.
+void batchUseCache(Batch *batch, ConversionCache *cache)
+{
+    batch->cache = cache;
+}
+
+// Has the workers call notify(data) each time they post a message, so that the owner can be woken up to read it
+// instead of polling. notify is called on a worker thread, so it should do nothing more than arrange for the owner's
+// thread to call batchPopMessage() (with g_idle_add(), for example). Call it before pushing any jobs.
+void batchSetNotify(Batch *batch, BatchNotifyFunc notify, gpointer data)
+{
+    batch->notify = notify;
+    batch->notifyData = data;
+}
+
+// Has every conversion measure where its time goes, and attaches the resulting ConversionStats to its
+// BATCH_MESSAGE_FILE_DONE message. Call it before pushing any jobs.
+void batchCollectStats(Batch *batch)
+{
+    batch->collectStats = true;
+}
+
+// the key an output path is known by in batch->outputs; Windows and macOS normally ignore case in file names
+static gchar *outputKey(const gchar *path)
+{
+#if defined(G_OS_WIN32) || defined(__APPLE__)
+    return g_utf8_casefold(path, -1);
+#else
+    return g_strdup(path);
+#endif
+}
+
+static const gchar *outputWriter(Batch *batch, const gchar *path)
+{
+    gchar *key = outputKey(path);
+    const gchar *inputPath = g_hash_table_lookup(batch->outputs, key);
+    g_free(key);
+    return inputPath;
+}
+
+// Returns the input path of a job already pushed to the batch whose image or mask is the same file as outputPath or
+// its mask, or NULL if there is none. Two inputs can end up with the same output when they differ only in extension
+// ("foo.png" and "foo.gif"), or when the same file is given twice.
+const gchar *batchOutputOwner(Batch *batch, const gchar *outputPath)
+{
+    gchar *maskPath = maskPathForOutput(outputPath);
+    const gchar *owner = outputWriter(batch, outputPath);
+    if (owner == NULL)
+    {
+        owner = outputWriter(batch, maskPath);
+    }
+    g_free(maskPath);
+    return owner;
+}
+
+// Queues a conversion. Each pushed job produces exactly one BATCH_MESSAGE_FILE_DONE message. Queued jobs start
+// biggest first, judging by the dimensions in their headers, so they may finish in any order. A job whose output
+// would clash with one pushed earlier (see batchOutputOwner()) isn't run, since both would write the same file at
+// once; its BATCH_MESSAGE_FILE_DONE reports the clash as an error instead.
+void batchPush(Batch *batch, const gchar *inputPath, const gchar *outputPath, bool writeOutput, bool writeMask)
+{
+    const gchar *owner = batchOutputOwner(batch, outputPath);
+    if (owner)
+    {
+        BatchMessage *message = g_new0(BatchMessage, 1);
+        postLog(batch, "\nNot converting %s: its output %s is already written for %s\n", inputPath, outputPath, owner);
+        message->type = BATCH_MESSAGE_FILE_DONE;
+        message->ok = false;
+        message->inputPath = g_strdup(inputPath);
+        message->text = g_strdup_printf("same output file as %s", owner);
+        postMessage(batch, message);
+        return;
+    }
+
+    gchar *maskPath = maskPathForOutput(outputPath);
+    g_hash_table_insert(batch->outputs, outputKey(outputPath), g_strdup(inputPath));
+    g_hash_table_insert(batch->outputs, outputKey(maskPath), g_strdup(inputPath));
+    g_free(maskPath);
+
+    BatchJob *job = g_new(BatchJob, 1);
+    job->inputPath = g_strdup(inputPath);
+    job->outputPath = g_strdup(outputPath);
+    job->writeOutput = writeOutput;
+    job->writeMask = writeMask;
+    job->error = NULL;
+    job->bytesSaved = 0;
+    job->cost = estimateCost(inputPath);
+    job->sequence = batch->numPushed++;
+    job->upToDate = false;
+    job->stats = NULL;
+
+    // a job that a thread can start on right away takes that thread's CPU out of the spare ones
+    if (SDL_AtomicAdd(&batch->unfinished, 1) < batch->numThreads)
+    {
+        SDL_AtomicAdd(&batch->spareThreads, -1);
+    }
+    g_thread_pool_push(batch->pool, job, NULL);
+}
+
+// returns the next message from the workers, or NULL if none arrived within the timeout
+BatchMessage *batchPopMessage(Batch *batch, guint64 timeoutMicroseconds)
+{
+    return (BatchMessage*) g_async_queue_timeout_pop(batch->messages, timeoutMicroseconds);
+}
+
+void batchFreeMessage(BatchMessage *message)
+{
+    g_free(message->text);
+    g_free(message->inputPath);
+    g_free(message->stats);
+    g_free(message);
+}
+
+// Jobs that haven't started yet are skipped, and jobs in progress stop at the next row without saving anything. Safe
+// to call from any thread, and from a signal handler.
+void batchCancel(Batch *batch)
+{
+    SDL_AtomicSet(&batch->cancelled, 1);
+}
+
+// waits for all queued jobs to finish, then frees the batch along with any unread messages
+void batchFree(Batch *batch)
+{
+    BatchMessage *message;
+
+    g_thread_pool_free(batch->pool, FALSE, TRUE);
+    while ((message = g_async_queue_try_pop(batch->messages)))
+    {
+        batchFreeMessage(message);
+    }
+    g_async_queue_unref(batch->messages);
+    g_hash_table_destroy(batch->outputs);
+    g_free(batch);
+}
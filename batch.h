@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stdbool.h>
+#include <glib.h>
+#include "palapply.h"
+#include "cache.h"
+
+// A pool of worker threads that convert images in parallel. Jobs are pushed from one thread (normally the UI thread),
+// and the workers report back through a message queue, so only the thread that owns the batch ever touches the UI.
+// All jobs in a batch share one palette, which must stay alive until the batch is freed, and one set of conversion
+// options.
+
+typedef enum {
+    BATCH_MESSAGE_LOG,       // text is a line (or lines) to add to the log
+    BATCH_MESSAGE_FILE_DONE, // a job has finished; ok is false if it failed or was skipped due to cancellation
+} BatchMessageType;
+
+typedef struct {
+    BatchMessageType type;
+    gchar *text;      // log text, or the reason a job failed (NULL if it succeeded or was skipped)
+    gchar *inputPath; // input path of the job, for BATCH_MESSAGE_FILE_DONE only
+    bool ok;
+    long bytesSaved;  // for BATCH_MESSAGE_FILE_DONE in optimize mode, how much smaller the optimizer made the files
+    bool upToDate;    // for BATCH_MESSAGE_FILE_DONE, the job was skipped because the cache said it was up to date
+    gint64 elapsed;   // for BATCH_MESSAGE_FILE_DONE, how long the job took in microseconds
+    ConversionStats *stats; // for BATCH_MESSAGE_FILE_DONE after batchCollectStats(), if the file was converted
+} BatchMessage;
+
+typedef struct Batch Batch;
+typedef void (*BatchNotifyFunc)(gpointer data);
+
+Batch *batchNew(const Palette *palette, const ConvertOptions *options, int numThreads);
+void batchUseCache(Batch *batch, ConversionCache *cache);
+void batchSetNotify(Batch *batch, BatchNotifyFunc notify, gpointer data);
+void batchCollectStats(Batch *batch);
+const gchar *batchOutputOwner(Batch *batch, const gchar *outputPath);
+void batchPush(Batch *batch, const gchar *inputPath, const gchar *outputPath, bool writeOutput, bool writeMask);
+BatchMessage *batchPopMessage(Batch *batch, guint64 timeoutMicroseconds);
+void batchFreeMessage(BatchMessage *message);
+void batchCancel(Batch *batch);
+void batchFree(Batch *batch);
+gchar *maskPathForOutput(const gchar *outputPath);
+gchar *outputPathForInput(const gchar *outputDirPath, const gchar *relativePath);
+
+// Walks an input directory one file at a time, so that the files found so far can be converted while the rest of the
+// tree is still being read. Only files with one of the given extensions are returned, if any are given, along with
+// their paths relative to the top directory, which is where their results go under the output directory.
+typedef struct BatchScan BatchScan;
+
+gchar **parseExtensionList(const gchar *list);
+BatchScan *batchScanNew(const gchar *dirPath, gchar **extensions, int maxDepth);
+bool batchScanNext(BatchScan *scan, gchar **inputPath, gchar **relativePath);
+void batchScanSkip(BatchScan *scan, const gchar *path);
+void batchScanFree(BatchScan *scan);
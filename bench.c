@@ -0,0 +1,476 @@
+/*
+ * Copyright (c) 2018-2019 Bryan Cain
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Benchmarks each stage of a conversion on synthetic images: decoding with readSourceImage(), classifying alpha with
+// alphaType(), the nearest-color search on its own, encoding its result with saveIndices(), and saving the mask with
+// saveMask(). The images cover every kind of source PalApply accepts (RGBA with no, simple or partial transparency,
+// RGB, grayscale and indexed) at sizes from a small sprite up to an 8K atlas.
+//
+// Results are written as JSON Lines, one object per stage per image, so runs from different versions can be compared
+// with any script. palapply.c prints progress to standard output as it goes, which is why the results go to a file.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <png.h>
+#include "SDL_image.h"
+#include "palapply.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+#define DEFAULT_RESULTS_PATH "palapply-bench.jsonl"
+
+// Each stage is run repeatedly until it has processed at least this many pixels in total (but at least once and at
+// most MAX_REPETITIONS times), and the fastest run is reported.
+#define MIN_PIXELS_PER_STAGE (32 * 1024 * 1024)
+#define MAX_REPETITIONS 25
+
+typedef enum {
+    SOURCE_RGBA,
+    SOURCE_RGB,
+    SOURCE_GRAY,
+    SOURCE_INDEXED,
+} SourceFormat;
+
+typedef enum {
+    ALPHA_PATTERN_OPAQUE, // every pixel fully opaque
+    ALPHA_PATTERN_CUTOUT, // a sprite on a fully transparent background
+    ALPHA_PATTERN_SOFT,   // the same with a feathered edge, so it needs a mask
+} AlphaPattern;
+
+typedef struct {
+    const char *name;
+    int width;
+    int height;
+} ImageSize;
+
+typedef struct {
+    const char *name;
+    SourceFormat format;
+    AlphaPattern alpha;
+} SourceKind;
+
+static const ImageSize imageSizes[] = {
+    { "sprite", 96, 128 },
+    { "large-sprite", 512, 512 },
+    { "background", 2048, 1024 },
+    { "atlas-4k", 4096, 4096 },
+    { "atlas-8k", 8192, 8192 },
+};
+
+static const SourceKind sourceKinds[] = {
+    { "rgba-opaque", SOURCE_RGBA, ALPHA_PATTERN_OPAQUE },
+    { "rgba-cutout", SOURCE_RGBA, ALPHA_PATTERN_CUTOUT },
+    { "rgba-soft", SOURCE_RGBA, ALPHA_PATTERN_SOFT },
+    { "rgb", SOURCE_RGB, ALPHA_PATTERN_OPAQUE },
+    { "gray", SOURCE_GRAY, ALPHA_PATTERN_OPAQUE },
+    { "indexed", SOURCE_INDEXED, ALPHA_PATTERN_OPAQUE },
+};
+
+#define NUM_IMAGE_SIZES ((int)(sizeof(imageSizes) / sizeof(imageSizes[0])))
+#define NUM_SOURCE_KINDS ((int)(sizeof(sourceKinds) / sizeof(sourceKinds[0])))
+
+// peak resident set size of the process so far, in kilobytes
+static long peakRSSKilobytes(void)
+{
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) return 0;
+    return (long)(counters.PeakWorkingSetSize / 1024);
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+#ifdef __APPLE__
+    return usage.ru_maxrss / 1024; // bytes on macOS, kilobytes everywhere else
+#else
+    return usage.ru_maxrss;
+#endif
+#endif
+}
+
+static double secondsSince(Uint64 start)
+{
+    return (double)(SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+}
+
+// small deterministic generator, so every run benchmarks the same pixels
+static uint32_t nextRandom(uint32_t *state)
+{
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+// Alpha of the pixel at (x,y): a filled ellipse in the middle of the image, optionally with a soft edge.
+static uint8_t patternAlpha(AlphaPattern pattern, int x, int y, int width, int height)
+{
+    if (pattern == ALPHA_PATTERN_OPAQUE) return 255;
+
+    double dx = (x + 0.5) / width * 2.0 - 1.0, dy = (y + 0.5) / height * 2.0 - 1.0;
+    double distance = dx * dx + dy * dy; // < 1 inside the ellipse
+    if (pattern == ALPHA_PATTERN_CUTOUT) return distance < 0.8 ? 255 : 0;
+    if (distance < 0.6) return 255;
+    if (distance > 0.9) return 0;
+    return (uint8_t)(255 * (0.9 - distance) / 0.3);
+}
+
+// Writes a synthetic source image as a PNG in the given format. The colors are smooth gradients with a little noise,
+// which gives the nearest-color cache about as many distinct colors to deal with as typical game art does.
+static bool writeSourceImage(const char *path, const ImageSize *size, const SourceKind *kind)
+{
+    static const int channelsByFormat[] = {
+        [SOURCE_RGBA] = 4, [SOURCE_RGB] = 3, [SOURCE_GRAY] = 1, [SOURCE_INDEXED] = 1,
+    };
+    static const int colorTypeByFormat[] = {
+        [SOURCE_RGBA] = PNG_COLOR_TYPE_RGB_ALPHA, [SOURCE_RGB] = PNG_COLOR_TYPE_RGB,
+        [SOURCE_GRAY] = PNG_COLOR_TYPE_GRAY, [SOURCE_INDEXED] = PNG_COLOR_TYPE_PALETTE,
+    };
+    int channels = channelsByFormat[kind->format];
+    uint32_t seed = 0x9e3779b9u;
+    png_color colors[256];
+    png_structp png_ptr = NULL;
+    png_infop info_ptr = NULL;
+    bool ok = false;
+
+    uint8_t *row = malloc((size_t) size->width * channels);
+    FILE *fp = row ? fopen(path, "wb") : NULL;
+    if (!fp) goto done;
+
+    png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    if (png_ptr) info_ptr = png_create_info_struct(png_ptr);
+    if (!info_ptr || setjmp(png_jmpbuf(png_ptr))) goto done;
+
+    png_init_io(png_ptr, fp);
+    png_set_compression_level(png_ptr, 1);
+    png_set_IHDR(png_ptr, info_ptr, size->width, size->height, 8, colorTypeByFormat[kind->format],
+                 PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    if (kind->format == SOURCE_INDEXED)
+    {
+        for (int i = 0; i < 256; i++)
+        {
+            colors[i] = (png_color) { (png_byte) i, (png_byte)(255 - i), (png_byte)((i * 7) & 0xff) };
+        }
+        png_set_PLTE(png_ptr, info_ptr, colors, 256);
+    }
+    png_write_info(png_ptr, info_ptr);
+
+    for (int y = 0; y < size->height; y++)
+    {
+        for (int x = 0; x < size->width; x++)
+        {
+            uint8_t noise = nextRandom(&seed) & 0x0f;
+            uint8_t *pixel = row + (size_t) x * channels;
+            uint8_t r = (uint8_t)(x * 255 / size->width) ^ noise;
+            uint8_t g = (uint8_t)(y * 255 / size->height) ^ noise;
+            uint8_t b = (uint8_t)((x + y) * 127 / (size->width + size->height)) + noise;
+
+            switch (kind->format)
+            {
+                case SOURCE_RGBA:
+                    pixel[3] = patternAlpha(kind->alpha, x, y, size->width, size->height);
+                    // fall through
+                case SOURCE_RGB:
+                    pixel[0] = r;
+                    pixel[1] = g;
+                    pixel[2] = b;
+                    break;
+                case SOURCE_GRAY:
+                    pixel[0] = (uint8_t)((r * 77 + g * 150 + b * 29) >> 8);
+                    break;
+                case SOURCE_INDEXED:
+                    pixel[0] = r ^ (g >> 2);
+                    break;
+            }
+        }
+        png_write_row(png_ptr, row);
+    }
+    png_write_end(png_ptr, info_ptr);
+    ok = true;
+
+done:
+    if (png_ptr) png_destroy_write_struct(&png_ptr, info_ptr ? &info_ptr : NULL);
+    if (fp) ok = (fclose(fp) == 0) && ok;
+    free(row);
+    return ok;
+}
+
+// Writes a 256-color palette in .act format: a 6x7x6 color cube with a run of grays after it. Color 0 is the
+// transparent color, like in a real OpenBOR palette.
+static bool writePalette(const char *path)
+{
+    uint8_t act[768];
+    int n = 0;
+
+    act[n++] = 0; act[n++] = 0; act[n++] = 0;
+    for (int r = 0; r < 6; r++)
+    {
+        for (int g = 0; g < 7; g++)
+        {
+            for (int b = 0; b < 6; b++)
+            {
+                act[n++] = r * 51;
+                act[n++] = g * 42;
+                act[n++] = b * 51;
+            }
+        }
+    }
+    for (int gray = 1; n < 768; gray++)
+    {
+        uint8_t value = (uint8_t)(gray * 255 / 4);
+        act[n++] = value;
+        act[n++] = value;
+        act[n++] = value;
+    }
+
+    FILE *fp = fopen(path, "wb");
+    if (!fp) return false;
+    bool ok = fwrite(act, 1, sizeof(act), fp) == sizeof(act);
+    return (fclose(fp) == 0) && ok;
+}
+
+typedef struct {
+    FILE *results;
+    const ImageSize *size;
+    const SourceKind *kind;
+    long sourceBytes; // size of the source PNG, for the decoding stage's MB/s
+} BenchCase;
+
+// Records one stage's fastest time. MB/s is measured against the image as 32-bit RGBA, which is what every stage
+// works on (or produces, for the decoder), except the decoder also reports the rate at which it reads the file.
+static void reportStage(const BenchCase *bench, const char *stage, double seconds, int repetitions, bool ok)
+{
+    double pixels = (double) bench->size->width * bench->size->height;
+    double pixelsPerSecond = seconds > 0 ? pixels / seconds : 0;
+
+    fprintf(bench->results,
+            "{\"version\":\"%s\",\"image\":\"%s\",\"source\":\"%s\",\"width\":%d,\"height\":%d,\"stage\":\"%s\","
+            "\"ok\":%s,\"repetitions\":%d,\"seconds\":%.6f,\"pixels_per_second\":%.0f,\"mb_per_second\":%.2f",
+            PALAPPLY_VERSION, bench->size->name, bench->kind->name, bench->size->width, bench->size->height, stage,
+            ok ? "true" : "false", repetitions, seconds, pixelsPerSecond, pixelsPerSecond * 4 / 1e6);
+    if (strcmp(stage, "read") == 0 && seconds > 0)
+    {
+        fprintf(bench->results, ",\"file_mb_per_second\":%.2f", bench->sourceBytes / seconds / 1e6);
+    }
+    fprintf(bench->results, ",\"peak_rss_kb\":%ld}\n", peakRSSKilobytes());
+    fflush(bench->results);
+
+    fprintf(stderr, "  %-8s %8.2f Mpixels/s %9.2f MB/s%s\n", stage, pixelsPerSecond / 1e6, pixelsPerSecond * 4 / 1e6,
+            ok ? "" : "  (FAILED)");
+}
+
+static int repetitionsFor(const ImageSize *size)
+{
+    long pixels = (long) size->width * size->height;
+    long repetitions = (MIN_PIXELS_PER_STAGE + pixels - 1) / pixels;
+    return repetitions > MAX_REPETITIONS ? MAX_REPETITIONS : (int) repetitions;
+}
+
+static long fileSize(const char *path)
+{
+    FILE *fp = fopen(path, "rb");
+    if (!fp) return 0;
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fclose(fp);
+    return size;
+}
+
+// Everything a stage needs. The image is decoded once outside of the timed decoding runs, so that every other stage
+// starts from the same surface.
+typedef struct {
+    const char *sourcePath;
+    const char *outputPath;
+    const Palette *pal;
+    SourceImage img;
+    uint8_t *indices;
+} StageContext;
+
+typedef bool (*StageFunc)(StageContext *context);
+
+static bool stageRead(StageContext *context)
+{
+    SourceImage decoded;
+    if (!readSourceImage(context->sourcePath, &decoded)) return false;
+    freeSourceImage(&decoded);
+    return true;
+}
+
+static bool stageAlpha(StageContext *context)
+{
+    return alphaType(context->img.surface) == context->img.alphaType;
+}
+
+static bool stageQuantize(StageContext *context)
+{
+    return quantizeImage(&context->img, context->pal, context->indices);
+}
+
+// encodes the indices left by the quantize stage, so that this is the PNG encoder's time alone
+static bool stageEncode(StageContext *context)
+{
+    SDL_Surface *surface = context->img.surface;
+    return saveIndices(context->outputPath, context->indices, surface->w, surface->h, context->pal);
+}
+
+static bool stageMask(StageContext *context)
+{
+    return saveMask(context->outputPath, &context->img);
+}
+
+// runs a stage repeatedly and reports its fastest time
+static void timeStage(const BenchCase *bench, const char *name, StageFunc stage, StageContext *context)
+{
+    int repetitions = repetitionsFor(bench->size);
+    double best = 0;
+    bool ok = true;
+    int i;
+
+    for (i = 0; i < repetitions && ok; i++)
+    {
+        Uint64 start = SDL_GetPerformanceCounter();
+        ok = stage(context);
+        double seconds = secondsSince(start);
+        if (i == 0 || seconds < best) best = seconds;
+    }
+    reportStage(bench, name, best, i, ok);
+}
+
+static void benchmarkCase(BenchCase *bench, const char *sourcePath, const char *outputPath, const Palette *pal)
+{
+    StageContext context = { sourcePath, outputPath, pal };
+
+    bench->sourceBytes = fileSize(sourcePath);
+    timeStage(bench, "read", stageRead, &context);
+
+    if (!readSourceImage(sourcePath, &context.img)) return;
+    context.indices = malloc((size_t) bench->size->width * bench->size->height);
+    if (context.indices)
+    {
+        timeStage(bench, "alpha", stageAlpha, &context);
+        timeStage(bench, "quantize", stageQuantize, &context);
+        timeStage(bench, "encode", stageEncode, &context);
+        timeStage(bench, "mask", stageMask, &context);
+    }
+
+    remove(outputPath);
+    free(context.indices);
+    freeSourceImage(&context.img);
+}
+
+static void printUsage(const char *programName)
+{
+    fprintf(stderr, "Usage: %s [options] [results_file]\n", programName);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Times each stage of a conversion on synthetic images and appends the results to\n"
+                    "results_file (default: " DEFAULT_RESULTS_PATH ") as JSON Lines.\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  --quick        skip the 4K and 8K atlases\n");
+    fprintf(stderr, "  --only NAME    only run images whose size or source name contains NAME\n");
+    fprintf(stderr, "  --dir PATH     where to write the temporary images (default: the current directory)\n");
+}
+
+int main(int argc, char **argv)
+{
+    const char *resultsPath = DEFAULT_RESULTS_PATH;
+    const char *only = NULL;
+    const char *tempDir = ".";
+    bool quick = false;
+    char palettePath[4096], sourcePath[4096], outputPath[4096];
+    int i;
+
+    for (i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--quick") == 0)
+        {
+            quick = true;
+        }
+        else if (strcmp(argv[i], "--only") == 0 && i + 1 < argc)
+        {
+            only = argv[++i];
+        }
+        else if (strcmp(argv[i], "--dir") == 0 && i + 1 < argc)
+        {
+            tempDir = argv[++i];
+        }
+        else if (argv[i][0] == '-')
+        {
+            printUsage(argv[0]);
+            return 1;
+        }
+        else
+        {
+            resultsPath = argv[i];
+        }
+    }
+
+    snprintf(palettePath, sizeof(palettePath), "%s/palapply-bench-palette.act", tempDir);
+    snprintf(sourcePath, sizeof(sourcePath), "%s/palapply-bench-source.png", tempDir);
+    snprintf(outputPath, sizeof(outputPath), "%s/palapply-bench-output.png", tempDir);
+
+    FILE *results = fopen(resultsPath, "a");
+    if (!results)
+    {
+        fprintf(stderr, "error: can't open '%s' for writing\n", resultsPath);
+        return 1;
+    }
+
+    Palette *pal = writePalette(palettePath) ? readPalette(palettePath) : NULL;
+    remove(palettePath);
+    if (!pal)
+    {
+        fprintf(stderr, "error: can't create the palette in '%s'\n", tempDir);
+        fclose(results);
+        return 1;
+    }
+
+    for (int s = 0; s < NUM_IMAGE_SIZES; s++)
+    {
+        const ImageSize *size = &imageSizes[s];
+        if (quick && size->width * size->height >= 4096 * 4096) continue;
+
+        for (int k = 0; k < NUM_SOURCE_KINDS; k++)
+        {
+            const SourceKind *kind = &sourceKinds[k];
+            if (only && !strstr(size->name, only) && !strstr(kind->name, only)) continue;
+
+            fprintf(stderr, "%s %s (%dx%d)\n", size->name, kind->name, size->width, size->height);
+            if (!writeSourceImage(sourcePath, size, kind))
+            {
+                fprintf(stderr, "  failed to write the source image\n");
+                continue;
+            }
+
+            BenchCase bench = { results, size, kind, 0 };
+            benchmarkCase(&bench, sourcePath, outputPath, pal);
+            remove(sourcePath);
+        }
+    }
+
+    freePalette(pal);
+    fclose(results);
+    return 0;
+}
@@ -0,0 +1,300 @@
+/*
+ * Copyright (c) 2018-2019 Bryan Cain
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// On-disk record of earlier conversions, used to skip inputs whose outputs are already up to date.
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include "palapply.h"
+#include "cache.h"
+
+#ifdef G_OS_WIN32
+#include <windows.h>
+#endif
+
+// First line of the cache file. Change the number whenever the file layout changes.
+#define CACHE_FILE_HEADER "palapply-cache 2"
+
+// Hashed into every key. Change it whenever a change to the conversion itself means that the same inputs no longer
+// give the same outputs, so that old entries stop matching.
+#define CACHE_KEY_VERSION "palapply conversion 2"
+
+typedef struct {
+    gchar *key;
+    gint64 modifiedTime; // in whatever units statFile() gets from the system; only ever compared for equality
+    gint64 size;
+} CacheEntry;
+
+struct ConversionCache {
+    gchar *outputDirPath;
+    gchar *cachePath;
+    GHashTable *entries; // path relative to the output directory -> CacheEntry
+    GMutex lock;
+    bool dirty;
+};
+
+static void freeCacheEntry(gpointer data)
+{
+    CacheEntry *entry = (CacheEntry*) data;
+    g_free(entry->key);
+    g_free(entry);
+}
+
+// the name of an output file in the cache, which is relative to the output directory so that the directory can move
+static gchar *cacheName(ConversionCache *cache, const gchar *path)
+{
+    size_t dirLength = strlen(cache->outputDirPath);
+    if (strncmp(path, cache->outputDirPath, dirLength) == 0 && path[dirLength] == '/')
+    {
+        return g_strdup(path + dirLength + 1);
+    }
+    return g_strdup(path);
+}
+
+// Gets a file's size and modification time. The time is as precise as the system keeps it (nanoseconds on most
+// systems, 100-nanosecond ticks on Windows), so that a file rewritten within the same second as it was recorded
+// doesn't pass for the recorded one just because its size happens to match.
+static bool statFile(const gchar *path, gint64 *modifiedTime, gint64 *size)
+{
+#ifdef G_OS_WIN32
+    WIN32_FILE_ATTRIBUTE_DATA info;
+    gunichar2 *widePath = g_utf8_to_utf16(path, -1, NULL, NULL, NULL);
+    bool ok = widePath && GetFileAttributesExW(widePath, GetFileExInfoStandard, &info);
+    g_free(widePath);
+    if (!ok)
+    {
+        return false;
+    }
+    *modifiedTime = (gint64) (((guint64) info.ftLastWriteTime.dwHighDateTime << 32) |
+                              info.ftLastWriteTime.dwLowDateTime);
+    *size = (gint64) (((guint64) info.nFileSizeHigh << 32) | info.nFileSizeLow);
+#else
+    GStatBuf info;
+    if (g_stat(path, &info) != 0)
+    {
+        return false;
+    }
+#ifdef __APPLE__
+    *modifiedTime = (gint64) info.st_mtimespec.tv_sec * 1000000000 + info.st_mtimespec.tv_nsec;
+#else
+    *modifiedTime = (gint64) info.st_mtim.tv_sec * 1000000000 + info.st_mtim.tv_nsec;
+#endif
+    *size = (gint64) info.st_size;
+#endif
+    return true;
+}
+
+// Loads the cache for an output directory. A missing or unreadable cache file just gives an empty cache.
+ConversionCache *conversionCacheOpen(const gchar *outputDirPath)
+{
+    ConversionCache *cache = g_new0(ConversionCache, 1);
+    gchar *contents = NULL;
+
+    cache->outputDirPath = g_strdup(outputDirPath);
+    cache->cachePath = g_strdup_printf("%s/%s", outputDirPath, CONVERSION_CACHE_FILENAME);
+    cache->entries = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, freeCacheEntry);
+    g_mutex_init(&cache->lock);
+
+    if (!g_file_get_contents(cache->cachePath, &contents, NULL, NULL))
+    {
+        return cache;
+    }
+
+    gchar **lines = g_strsplit(contents, "\n", -1);
+    if (lines[0] && strcmp(lines[0], CACHE_FILE_HEADER) == 0)
+    {
+        // each line is: key, modification time, size, path
+        for (gchar **line = lines + 1; *line; line++)
+        {
+            gchar **fields = g_strsplit(*line, "\t", 4);
+            if (g_strv_length(fields) == 4 && fields[0][0] != '\0' && fields[3][0] != '\0')
+            {
+                CacheEntry *entry = g_new(CacheEntry, 1);
+                entry->key = g_strdup(fields[0]);
+                entry->modifiedTime = g_ascii_strtoll(fields[1], NULL, 10);
+                entry->size = g_ascii_strtoll(fields[2], NULL, 10);
+                g_hash_table_insert(cache->entries, g_strdup(fields[3]), entry);
+            }
+            g_strfreev(fields);
+        }
+    }
+    g_strfreev(lines);
+    g_free(contents);
+    return cache;
+}
+
+// Hashes everything that the result of converting inputPath depends on. Returns NULL if the input can't be read.
+gchar *conversionCacheKey(const gchar *inputPath, const Palette *palette, const ConvertOptions *options)
+{
+    FILE *fp = fopen(inputPath, "rb");
+    if (!fp)
+    {
+        return NULL;
+    }
+
+    GChecksum *checksum = g_checksum_new(G_CHECKSUM_SHA256);
+    guchar buffer[65536];
+    size_t length;
+
+    g_checksum_update(checksum, (const guchar*) CACHE_KEY_VERSION, -1);
+    while ((length = fread(buffer, 1, sizeof(buffer), fp)) > 0)
+    {
+        g_checksum_update(checksum, buffer, length);
+    }
+    bool readError = ferror(fp);
+    fclose(fp);
+
+    SDL_Color colors[256];
+    int ncolors = paletteColors(palette, colors);
+    for (int i = 0; i < ncolors; i++)
+    {
+        guchar rgb[3] = { colors[i].r, colors[i].g, colors[i].b };
+        g_checksum_update(checksum, rgb, sizeof(rgb));
+    }
+
+    // writeImage and writeMask are left out since they only say which files to skip, not what goes in them
+    gchar *optionText = g_strdup_printf("ncolors=%d compression=%d metric=%d dither=%d optimize=%d reorder=%d",
+                                        ncolors, (int) options->compression, (int) options->metric,
+                                        (int) options->dither, options->optimize, options->reorderPalette);
+    g_checksum_update(checksum, (const guchar*) optionText, -1);
+    g_free(optionText);
+
+    gchar *key = readError ? NULL : g_strdup(g_checksum_get_string(checksum));
+    g_checksum_free(checksum);
+    return key;
+}
+
+// true if there's an entry for the file with the given key (or any key, if key is NULL) and the file hasn't changed
+static bool entryIsCurrent(ConversionCache *cache, const gchar *path, const gchar *key)
+{
+    gchar *name = cacheName(cache, path);
+    gint64 modifiedTime, size;
+    bool current = false;
+
+    if (statFile(path, &modifiedTime, &size))
+    {
+        g_mutex_lock(&cache->lock);
+        CacheEntry *entry = g_hash_table_lookup(cache->entries, name);
+        current = entry && (key == NULL || strcmp(entry->key, key) == 0) &&
+                  entry->modifiedTime == modifiedTime && entry->size == size;
+        g_mutex_unlock(&cache->lock);
+    }
+
+    g_free(name);
+    return current;
+}
+
+// True if the output was made from the same input with the same settings, and neither it nor its mask (if the
+// conversion produced one) has been changed or removed since.
+bool conversionCacheIsCurrent(ConversionCache *cache, const gchar *outputPath, const gchar *maskPath, const gchar *key)
+{
+    if (!entryIsCurrent(cache, outputPath, key))
+    {
+        return false;
+    }
+
+    gchar *maskName = cacheName(cache, maskPath);
+    g_mutex_lock(&cache->lock);
+    bool hasMask = g_hash_table_lookup(cache->entries, maskName) != NULL;
+    g_mutex_unlock(&cache->lock);
+    g_free(maskName);
+
+    return !hasMask || entryIsCurrent(cache, maskPath, key);
+}
+
+// true if the file was written by an earlier conversion and hasn't been changed since, so it's safe to replace
+bool conversionCacheOwnsFile(ConversionCache *cache, const gchar *path)
+{
+    return entryIsCurrent(cache, path, NULL);
+}
+
+static void storeEntry(ConversionCache *cache, const gchar *path, const gchar *key)
+{
+    gchar *name = cacheName(cache, path);
+    CacheEntry *entry = g_new(CacheEntry, 1);
+
+    if (!statFile(path, &entry->modifiedTime, &entry->size))
+    {
+        g_free(entry);
+        g_free(name);
+        return;
+    }
+    entry->key = g_strdup(key);
+
+    g_mutex_lock(&cache->lock);
+    g_hash_table_insert(cache->entries, name, entry);
+    cache->dirty = true;
+    g_mutex_unlock(&cache->lock);
+}
+
+// Records a finished conversion. If it didn't need a mask, any older entry for the mask is dropped.
+void conversionCacheStore(ConversionCache *cache, const gchar *outputPath, const gchar *maskPath, const gchar *key,
+                          bool hasMask)
+{
+    storeEntry(cache, outputPath, key);
+
+    if (hasMask)
+    {
+        storeEntry(cache, maskPath, key);
+    }
+    else
+    {
+        gchar *name = cacheName(cache, maskPath);
+        g_mutex_lock(&cache->lock);
+        if (g_hash_table_remove(cache->entries, name)) cache->dirty = true;
+        g_mutex_unlock(&cache->lock);
+        g_free(name);
+    }
+}
+
+// writes the cache back to the output directory if anything changed
+bool conversionCacheSave(ConversionCache *cache)
+{
+    if (!cache->dirty)
+    {
+        return true;
+    }
+
+    GString *contents = g_string_new(CACHE_FILE_HEADER "\n");
+    GHashTableIter iter;
+    gpointer name, value;
+
+    g_hash_table_iter_init(&iter, cache->entries);
+    while (g_hash_table_iter_next(&iter, &name, &value))
+    {
+        CacheEntry *entry = (CacheEntry*) value;
+        g_string_append_printf(contents, "%s\t%" G_GINT64_FORMAT "\t%" G_GINT64_FORMAT "\t%s\n", entry->key,
+                               entry->modifiedTime, entry->size, (const gchar*) name);
+    }
+
+    bool ok = g_file_set_contents(cache->cachePath, contents->str, contents->len, NULL);
+    g_string_free(contents, TRUE);
+    cache->dirty = !ok;
+    return ok;
+}
+
+void conversionCacheFree(ConversionCache *cache)
+{
+    g_hash_table_unref(cache->entries);
+    g_mutex_clear(&cache->lock);
+    g_free(cache->cachePath);
+    g_free(cache->outputDirPath);
+    g_free(cache);
+}
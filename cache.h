@@ -0,0 +1,27 @@
+#pragma once
+
+#include <stdbool.h>
+#include <glib.h>
+#include "palapply.h"
+
+// Remembers which files in an output directory came from which conversions, so that a rerun over the same inputs can
+// skip the ones that haven't changed. Every file written is recorded with a key that hashes everything the result
+// depends on (the source file's bytes, the palette's colors and the conversion options), along with its size and
+// modification time so that a file edited or deleted since then gets converted again. The cache is stored in the
+// output directory as CONVERSION_CACHE_FILENAME.
+//
+// Everything except conversionCacheOpen(), conversionCacheSave() and conversionCacheFree() can be called from any
+// thread.
+
+#define CONVERSION_CACHE_FILENAME ".palapply-cache"
+
+typedef struct ConversionCache ConversionCache;
+
+ConversionCache *conversionCacheOpen(const gchar *outputDirPath);
+gchar *conversionCacheKey(const gchar *inputPath, const Palette *palette, const ConvertOptions *options);
+bool conversionCacheIsCurrent(ConversionCache *cache, const gchar *outputPath, const gchar *maskPath, const gchar *key);
+bool conversionCacheOwnsFile(ConversionCache *cache, const gchar *path);
+void conversionCacheStore(ConversionCache *cache, const gchar *outputPath, const gchar *maskPath, const gchar *key,
+                          bool hasMask);
+bool conversionCacheSave(ConversionCache *cache);
+void conversionCacheFree(ConversionCache *cache);
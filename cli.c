@@ -0,0 +1,620 @@
+/*
+ * Copyright (c) 2018-2019 Bryan Cain
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Command line interface. Converts either a single image, or any number of images in batch mode using the same
+// worker pool as the GUI.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <signal.h>
+#include <glib.h>
+#include "palapply.h"
+#include "batch.h"
+#include "stats.h"
+#include "cli.h"
+
+#define DEFAULT_INPUT_EXTENSIONS "png,gif,pcx,bmp"
+
+typedef struct {
+    Batch *batch;
+    const gchar *outputDirPath;
+    gchar **extensions; // lowercase, without the leading dot
+    bool recursive;
+    unsigned int queuedCount;
+    unsigned int doneCount;
+    unsigned int failedCount;
+    long bytesSaved;
+    GString *errorSummary;
+    StatsReport *stats; // NULL unless --stats or --stats-file was given
+} CliBatch;
+
+// the batch that Ctrl+C cancels
+static Batch *interruptibleBatch = NULL;
+
+// The first Ctrl+C cancels the batch, which stops the files being converted without leaving partial results behind
+// and then prints the usual summary. A second one kills the program outright.
+static void handleInterrupt(int signalNumber)
+{
+    signal(SIGINT, SIG_DFL);
+    if (interruptibleBatch) batchCancel(interruptibleBatch);
+}
+
+static void printUsage(const char *programName)
+{
+    fprintf(stderr, "Usage: %s [options] palette source result [result_mask]\n", programName);
+    fprintf(stderr, "       %s --batch [options] palette output_dir input...\n", programName);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "palette: an indexed PNG with the target palette\n");
+    fprintf(stderr, "source: the PNG to apply the palette to and generate the mask from;\n"
+                    "        can be RGB, indexed, or grayscale, with or without alpha\n");
+    fprintf(stderr, "result: path to which to save the resulting image as an indexed PNG\n");
+    fprintf(stderr, "result_mask: path to which to save the resulting alpha mask as a grayscale PNG\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "The result_mask parameter can be omitted to skip producing an alpha mask.\n");
+    fprintf(stderr, "Note that result and result_mask will be overwritten if the paths already exist.\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "In batch mode, each input can be an image file, a directory, or a wildcard pattern\n"
+                    "such as \"sprites/**/*.png\", where ** matches any number of subdirectories. An input\n"
+                    "of \"-\" reads more inputs from standard input, one per line. Results are saved to\n"
+                    "output_dir with a \".png\" extension, keeping the layout of any subdirectories, and\n"
+                    "alpha masks are saved next to them with a \"-mask.png\" suffix.\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Options for both modes:\n");
+    fprintf(stderr, "  -c, --compression P   how hard to compress the output files: fast, balanced or\n"
+                    "                        smallest (default: smallest)\n");
+    fprintf(stderr, "  -m, --metric M        how to measure the distance between colors when matching them to\n"
+                    "                        the palette: rgb, weighted, lab or oklab (default: rgb)\n");
+    fprintf(stderr, "  -d, --dither D        dither gradients with palette colors: none, ordered,\n"
+                    "                        floyd-steinberg or atkinson (default: none)\n");
+    fprintf(stderr, "  -O, --optimize        try many encodings of each file in parallel and keep the\n"
+                    "                        smallest; also drops unused colors from the end of the palette\n");
+    fprintf(stderr, "  --reorder-palette     with -O, also try renumbering the palette by how often each\n"
+                    "                        color is used (index 0 stays put)\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Batch options:\n");
+    fprintf(stderr, "  -j, --threads N       number of images to convert at once (default: one per CPU)\n");
+    fprintf(stderr, "  -r, --recursive       include subdirectories of input directories\n");
+    fprintf(stderr, "  -e, --extensions LIST comma-separated extensions of the images to take from input\n"
+                    "                        directories (default: " DEFAULT_INPUT_EXTENSIONS ")\n");
+    fprintf(stderr, "  --cache               skip inputs that haven't changed since the last run with the\n"
+                    "                        same palette and options (recorded in output_dir/" CONVERSION_CACHE_FILENAME ")\n");
+    fprintf(stderr, "  --stats               time each stage of each conversion and print a summary at the end\n");
+    fprintf(stderr, "  --stats-file PATH     save the timings and counters for each file to PATH, as CSV if it\n"
+                    "                        ends in \".csv\" and as JSON otherwise; implies --stats\n");
+}
+
+// Handles the options that work in both modes. Returns 1 if argv[*i] was one of them (advancing *i past any value it
+// took), 0 if it wasn't, or -1 if its value was invalid.
+static int parseConvertOption(int argc, char **argv, int *i, ConvertOptions *options)
+{
+    const char *arg = argv[*i];
+
+    if ((strcmp(arg, "-c") == 0 || strcmp(arg, "--compression") == 0) && *i + 1 < argc)
+    {
+        const char *name = argv[++*i];
+        if (!compressionProfileFromName(name, &options->compression))
+        {
+            fprintf(stderr, "error: unknown compression profile '%s'\n", name);
+            return -1;
+        }
+        return 1;
+    }
+    else if ((strcmp(arg, "-m") == 0 || strcmp(arg, "--metric") == 0) && *i + 1 < argc)
+    {
+        const char *name = argv[++*i];
+        if (!colorMetricFromName(name, &options->metric))
+        {
+            fprintf(stderr, "error: unknown color metric '%s'\n", name);
+            return -1;
+        }
+        return 1;
+    }
+    else if ((strcmp(arg, "-d") == 0 || strcmp(arg, "--dither") == 0) && *i + 1 < argc)
+    {
+        const char *name = argv[++*i];
+        if (!ditherModeFromName(name, &options->dither))
+        {
+            fprintf(stderr, "error: unknown dithering mode '%s'\n", name);
+            return -1;
+        }
+        return 1;
+    }
+    else if (strcmp(arg, "-O") == 0 || strcmp(arg, "--optimize") == 0)
+    {
+        options->optimize = true;
+        return 1;
+    }
+    else if (strcmp(arg, "--reorder-palette") == 0)
+    {
+        options->reorderPalette = true;
+        return 1;
+    }
+    return 0;
+}
+
+static int convertSingleFile(int argc, char **argv, const ConvertOptions *options)
+{
+    Palette *pal = readPalette(argv[1]);
+    if (!pal)
+    {
+        fprintf(stderr, "error: failed to load palette image '%s'\n", argv[1]);
+        goto error;
+    }
+
+    ConvertResult result;
+    bool ok = convertImageFile(argv[2], pal, options, argv[3], argc >= 5 ? argv[4] : NULL, &result);
+
+    if (result.sourceRead)
+    {
+        printf("read image %s\n", argv[2]);
+    }
+    else
+    {
+        fprintf(stderr, "error: failed to load image %s\n", argv[2]);
+        goto error;
+    }
+
+    if (!result.imageWritten)
+    {
+        fprintf(stderr, "error: failed to save result '%s'\n", argv[3]);
+        goto error;
+    } else printf("saved result to '%s'\n", argv[3]);
+
+    if (options->optimize)
+    {
+        printf("optimized output is %ld bytes smaller than with the plain compression profile\n", result.bytesSaved);
+    }
+
+    if (result.alphaType == ALPHA_MASK_NEEDED)
+    {
+        if (argc < 5)
+        {
+            fprintf(stderr, "warning: source has non-trivial alpha, but no mask filename given");
+        }
+        else if (!ok)
+        {
+            fprintf(stderr, "error: failed to save alpha mask '%s'\n", argv[4]);
+            goto error;
+        }
+        else printf("saved alpha mask to '%s'\n", argv[4]);
+    }
+    else if (result.alphaType == ALPHA_SIMPLE) printf("no alpha mask needed (simple alpha channel)\n");
+    else printf("no alpha mask needed (source has no alpha channel)\n");
+
+    freePalette(pal);
+
+    return 0;
+
+error:
+    freePalette(pal);
+    return 1;
+}
+
+// Prints log lines from the workers and records finished files. Waits up to timeoutMicroseconds for the first
+// message to arrive.
+static void handleMessages(CliBatch *cli, guint64 timeoutMicroseconds)
+{
+    BatchMessage *message;
+
+    while ((message = batchPopMessage(cli->batch, timeoutMicroseconds)))
+    {
+        if (cli->stats)
+        {
+            statsReportAdd(cli->stats, message);
+        }
+        if (message->type == BATCH_MESSAGE_LOG)
+        {
+            fputs(message->text, stdout);
+        }
+        else if (message->type == BATCH_MESSAGE_FILE_DONE)
+        {
+            ++cli->doneCount;
+            cli->bytesSaved += message->bytesSaved;
+            if (!message->ok)
+            {
+                ++cli->failedCount;
+                g_string_append_printf(cli->errorSummary, "  %s: %s\n", message->inputPath,
+                                       message->text ? message->text : "not converted");
+            }
+        }
+        batchFreeMessage(message);
+        timeoutMicroseconds = 0;
+    }
+}
+
+// Queues one image. relativePath is where the result goes relative to the output directory; its extension is
+// replaced with ".png". Plain files and wildcard matches only keep their base name or the part after the pattern's
+// base directory, so two inputs can end up with the same result; batchPush() fails the second one. If the file came
+// from a directory scan, its results are left out of the rest of the scan, so that an output directory inside the
+// input directory doesn't feed them back in as inputs.
+static void queueFile(CliBatch *cli, const gchar *inputPath, const gchar *relativePath, BatchScan *scan)
+{
+    gchar *outputPath = outputPathForInput(cli->outputDirPath, relativePath);
+
+    if (scan)
+    {
+        gchar *maskPath = maskPathForOutput(outputPath);
+        batchScanSkip(scan, outputPath);
+        batchScanSkip(scan, maskPath);
+        g_free(maskPath);
+    }
+
+    batchPush(cli->batch, inputPath, outputPath, true, true);
+    ++cli->queuedCount;
+    g_free(outputPath);
+
+    // print progress as we go instead of letting it pile up until the end
+    handleMessages(cli, 0);
+}
+
+// Queues the images in a directory as they are found, so the first ones are being converted while the rest of the
+// tree is still being read.
+static void queueDirectory(CliBatch *cli, const gchar *dirPath)
+{
+    BatchScan *scan = batchScanNew(dirPath, cli->extensions, cli->recursive ? -1 : 0);
+    gchar *inputPath, *relativePath;
+
+    if (scan == NULL)
+    {
+        fprintf(stderr, "warning: failed to open directory '%s'\n", dirPath);
+        return;
+    }
+
+    while (batchScanNext(scan, &inputPath, &relativePath))
+    {
+        queueFile(cli, inputPath, relativePath, scan);
+        g_free(inputPath);
+        g_free(relativePath);
+    }
+
+    batchScanFree(scan);
+}
+
+// Matches a path against a wildcard pattern. "*" and "?" don't match across directory separators, but "**/"
+// matches any number of whole directories, including none.
+static bool globMatch(const char *pattern, const char *path)
+{
+    if (pattern[0] == '*' && pattern[1] == '*' && (pattern[2] == '/' || pattern[2] == '\0'))
+    {
+        if (pattern[2] == '\0')
+        {
+            return true;
+        }
+
+        for (const char *p = path; p != NULL; p = strchr(p, '/'))
+        {
+            if (*p == '/') p++;
+            if (globMatch(pattern + 3, p)) return true;
+        }
+        return false;
+    }
+    else if (pattern[0] == '*')
+    {
+        for (const char *p = path; ; p++)
+        {
+            if (globMatch(pattern + 1, p)) return true;
+            if (*p == '\0' || *p == '/') return false;
+        }
+    }
+    else if (pattern[0] == '?')
+    {
+        return *path != '\0' && *path != '/' && globMatch(pattern + 1, path + 1);
+    }
+    else if (pattern[0] == '\0')
+    {
+        return *path == '\0';
+    }
+    else
+    {
+        return *pattern == *path && globMatch(pattern + 1, path + 1);
+    }
+}
+
+// Queues the files under dirPath whose paths relative to it match the pattern. This is a directory scan like any
+// other, so it leaves out symbolic links to directories and the results it has already queued. maxDepth is the number
+// of directory levels to descend, or -1 for no limit.
+static void queueGlobDirectory(CliBatch *cli, const gchar *dirPath, const gchar *pattern, int maxDepth)
+{
+    BatchScan *scan = batchScanNew(dirPath, NULL, maxDepth);
+    gchar *inputPath, *relativePath;
+
+    if (scan == NULL)
+    {
+        return;
+    }
+
+    while (batchScanNext(scan, &inputPath, &relativePath))
+    {
+        if (globMatch(pattern, relativePath))
+        {
+            queueFile(cli, inputPath, relativePath, scan);
+        }
+        g_free(inputPath);
+        g_free(relativePath);
+    }
+
+    batchScanFree(scan);
+}
+
+static void queueGlob(CliBatch *cli, const gchar *rawPattern)
+{
+    gchar *pattern = g_strdup(rawPattern);
+#ifdef _WIN32
+    g_strdelimit(pattern, "\\", '/');
+#endif
+
+    // Everything before the directory containing the first wildcard is a fixed base directory. Results keep their
+    // layout relative to it.
+    size_t wildcardPos = strcspn(pattern, "*?");
+    gchar *baseDir;
+    const gchar *relativePattern;
+    gchar *lastSlash = g_strrstr_len(pattern, wildcardPos, "/");
+    if (lastSlash == NULL)
+    {
+        baseDir = g_strdup(".");
+        relativePattern = pattern;
+    }
+    else
+    {
+        baseDir = (lastSlash == pattern) ? g_strdup("/") : g_strndup(pattern, lastSlash - pattern);
+        relativePattern = lastSlash + 1;
+    }
+
+    int maxDepth = -1;
+    if (strstr(relativePattern, "**") == NULL)
+    {
+        maxDepth = 0;
+        for (const gchar *c = relativePattern; *c; c++)
+        {
+            if (*c == '/') ++maxDepth;
+        }
+    }
+
+    unsigned int oldQueuedCount = cli->queuedCount;
+    queueGlobDirectory(cli, baseDir, relativePattern, maxDepth);
+    if (cli->queuedCount == oldQueuedCount)
+    {
+        fprintf(stderr, "warning: no files match '%s'\n", rawPattern);
+    }
+
+    g_free(baseDir);
+    g_free(pattern);
+}
+
+static void queueInput(CliBatch *cli, const gchar *input)
+{
+    if (strpbrk(input, "*?"))
+    {
+        queueGlob(cli, input);
+    }
+    else if (g_file_test(input, G_FILE_TEST_IS_DIR))
+    {
+        queueDirectory(cli, input);
+    }
+    else
+    {
+        gchar *baseName = g_path_get_basename(input);
+        queueFile(cli, input, baseName, NULL);
+        g_free(baseName);
+    }
+}
+
+// reads inputs from standard input, one per line
+static void queueInputsFromStdin(CliBatch *cli)
+{
+    char line[4096];
+
+    while (fgets(line, sizeof(line), stdin))
+    {
+        g_strstrip(line);
+        if (line[0] != '\0')
+        {
+            queueInput(cli, line);
+        }
+    }
+}
+
+static int batchMain(int argc, char **argv)
+{
+    int numThreads = 0;
+    const char *extensionList = DEFAULT_INPUT_EXTENSIONS;
+    bool recursive = false;
+    bool useCache = false;
+    bool collectStats = false;
+    const char *statsPath = NULL;
+    ConvertOptions options;
+    int i, parsed;
+
+    defaultConvertOptions(&options);
+
+    for (i = 2; i < argc && argv[i][0] == '-' && argv[i][1] != '\0'; i++)
+    {
+        if ((strcmp(argv[i], "-j") == 0 || strcmp(argv[i], "--threads") == 0) && i + 1 < argc)
+        {
+            numThreads = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-r") == 0 || strcmp(argv[i], "--recursive") == 0)
+        {
+            recursive = true;
+        }
+        else if ((strcmp(argv[i], "-e") == 0 || strcmp(argv[i], "--extensions") == 0) && i + 1 < argc)
+        {
+            extensionList = argv[++i];
+        }
+        else if (strcmp(argv[i], "--cache") == 0)
+        {
+            useCache = true;
+        }
+        else if (strcmp(argv[i], "--stats") == 0)
+        {
+            collectStats = true;
+        }
+        else if (strcmp(argv[i], "--stats-file") == 0 && i + 1 < argc)
+        {
+            collectStats = true;
+            statsPath = argv[++i];
+        }
+        else if ((parsed = parseConvertOption(argc, argv, &i, &options)) != 0)
+        {
+            if (parsed < 0) return 1;
+        }
+        else
+        {
+            fprintf(stderr, "error: unknown option '%s'\n\n", argv[i]);
+            printUsage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (argc - i < 3)
+    {
+        printUsage(argv[0]);
+        return 1;
+    }
+
+    const char *palettePath = argv[i++];
+    Palette *palette = readPalette(palettePath);
+    if (!palette)
+    {
+        fprintf(stderr, "error: failed to load palette image '%s'\n", palettePath);
+        return 1;
+    }
+
+    CliBatch cli;
+    cli.batch = batchNew(palette, &options, numThreads);
+    cli.outputDirPath = argv[i++];
+    cli.extensions = parseExtensionList(extensionList);
+    cli.recursive = recursive;
+    cli.queuedCount = 0;
+    cli.doneCount = 0;
+    cli.failedCount = 0;
+    cli.bytesSaved = 0;
+    cli.errorSummary = g_string_new(NULL);
+    cli.stats = collectStats ? statsReportNew() : NULL;
+    if (collectStats) batchCollectStats(cli.batch);
+
+    ConversionCache *cache = useCache ? conversionCacheOpen(cli.outputDirPath) : NULL;
+    if (cache) batchUseCache(cli.batch, cache);
+
+    interruptibleBatch = cli.batch;
+    signal(SIGINT, handleInterrupt);
+
+    for (; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-") == 0)
+        {
+            queueInputsFromStdin(&cli);
+        }
+        else
+        {
+            queueInput(&cli, argv[i]);
+        }
+    }
+
+    while (cli.doneCount < cli.queuedCount)
+    {
+        handleMessages(&cli, G_USEC_PER_SEC);
+    }
+    signal(SIGINT, SIG_DFL);
+    interruptibleBatch = NULL;
+    batchFree(cli.batch);
+    freePalette(palette);
+
+    if (cache)
+    {
+        if (!conversionCacheSave(cache))
+        {
+            fprintf(stderr, "warning: failed to save the conversion cache in '%s'\n", cli.outputDirPath);
+        }
+        conversionCacheFree(cache);
+    }
+
+    int result = 0;
+    if (cli.failedCount > 0)
+    {
+        fprintf(stderr, "\n%u of %u files failed:\n%s", cli.failedCount, cli.queuedCount, cli.errorSummary->str);
+        result = 1;
+    }
+    else if (cli.queuedCount == 0)
+    {
+        fprintf(stderr, "error: no input files\n");
+        result = 1;
+    }
+    else
+    {
+        printf("\nConverted %u files\n", cli.queuedCount);
+        if (options.optimize) printf("Optimizing saved %ld bytes\n", cli.bytesSaved);
+    }
+
+    if (cli.stats)
+    {
+        gchar *summary = statsReportSummary(cli.stats);
+        fputs(summary, stdout);
+        g_free(summary);
+        if (statsPath && !statsReportSave(cli.stats, statsPath))
+        {
+            fprintf(stderr, "warning: failed to save statistics to '%s'\n", statsPath);
+        }
+        statsReportFree(cli.stats);
+    }
+
+    g_string_free(cli.errorSummary, TRUE);
+    g_strfreev(cli.extensions);
+    return result;
+}
+
+int commandLineMain(int argc, char **argv)
+{
+    if (argc >= 2 && strcmp(argv[1], "--batch") == 0)
+    {
+        return batchMain(argc, argv);
+    }
+
+    ConvertOptions options;
+    int i, parsed;
+    defaultConvertOptions(&options);
+
+    for (i = 1; i < argc && argv[i][0] == '-' && argv[i][1] != '\0'; i++)
+    {
+        parsed = parseConvertOption(argc, argv, &i, &options);
+        if (parsed < 0) return 1;
+        if (parsed == 0)
+        {
+            fprintf(stderr, "error: unknown option '%s'\n\n", argv[i]);
+            printUsage(argv[0]);
+            return 1;
+        }
+    }
+
+    // drop the options so that the positional arguments are where convertSingleFile() expects them
+    if (i > 1)
+    {
+        argv[i - 1] = argv[0];
+        argv += i - 1;
+        argc -= i - 1;
+    }
+
+    if (argc != 4 && argc != 5) // alpha masking is optional
+    {
+        printUsage(argv[0]);
+        return 1;
+    }
+
+    return convertSingleFile(argc, argv, &options);
+}
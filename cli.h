@@ -0,0 +1,3 @@
+#pragma once
+
+int commandLineMain(int argc, char **argv);
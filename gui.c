@@ -19,6 +19,10 @@
 #include <stdbool.h>
 #include <gtk/gtk.h>
 #include "palapply.h"
+#include "batch.h"
+#include "cache.h"
+#include "stats.h"
+#include "cli.h"
 #include "helpfiles.h"
 
 // disable SDL_main definition
@@ -281,6 +285,51 @@ static void choose_output_directory_batch(GtkWidget *widget, gpointer data)
     choose_directory(builder, entry, "Select output directory");
 }
 
+// State of a running conversion, as seen from the UI thread. The workers report back through idle callbacks, so the
+// signal handler that starts a conversion returns as soon as everything is queued and the main loop keeps running
+// while the files are converted.
+typedef struct {
+    GtkBuilder *builder;
+    Batch *batch;           // NULL when no conversion is running
+    Palette *palette;
+    ConversionCache *cache; // NULL unless unchanged files are being skipped
+    StatsReport *stats;     // NULL unless timing statistics were asked for
+    GtkProgressBar *progressBar;
+    GtkTextView *progressTextView;
+    GtkTextBuffer *progressLog;
+    BatchScan *scan;        // the input directory being read in batch mode, or NULL once every file has been queued
+    gchar *outputDirPath;   // where the results of the scan go
+    guint scanSource;       // source ID of the pending progress_scan_idle(), or 0
+    gint overwriteResponse; // the last answer to an overwrite prompt, so that "Yes to all" sticks
+    unsigned int queuedCount;
+    unsigned int doneCount;
+    bool batchMode;
+    bool queueingDone;      // every file that will be converted has been queued
+    bool canceled;
+    bool ok;
+    gint idleQueued;        // set while a call to progress_idle() is pending
+    GString *pendingLog;    // log text that hasn't been added to the text view yet
+    guint flushTimer;       // source ID of the pending progress_flush_timeout(), or 0
+} ConversionProgress;
+
+// The log and progress bar are updated at most this often while a conversion runs, however fast files finish, and
+// the log only keeps the last LOG_MAX_LINES lines. That keeps the cost of showing progress the same for a batch of
+// 10 files or 50,000.
+#define LOG_FLUSH_INTERVAL_MS 100
+#define LOG_MAX_LINES 2000
+#define LOG_MAX_PENDING_BYTES (256 * 1024)
+
+// How long each call to progress_scan_idle() spends reading the input directory and queueing files before it lets the
+// main loop handle other events.
+#define SCAN_SLICE_US 10000
+
+// name of the per-file statistics table saved in the output directory
+#define STATS_FILENAME "palapply-stats.csv"
+
+// Only one conversion runs at a time, and the Convert buttons are disabled while it does. This lives for the whole
+// program, so an idle callback that fires after the conversion it was queued for has finished is harmless.
+static ConversionProgress conversion;
+
 // enable the "Convert" button only if all required text fields have been filled
 static void convert_button_enable_single(GtkBuilder *builder)
 {
@@ -289,7 +338,7 @@ static void convert_button_enable_single(GtkBuilder *builder)
     gint palettePathCount = gtk_entry_buffer_get_length(gtk_entry_get_buffer(GTK_ENTRY(gtk_builder_get_object(builder, "singlePaletteFileEntry"))));
 
     gtk_widget_set_sensitive(GTK_WIDGET(gtk_builder_get_object(builder, "singleFileConvertButton")),
-            inputPathCount > 0 && outputPathCount > 0 && palettePathCount > 0);
+            inputPathCount > 0 && outputPathCount > 0 && palettePathCount > 0 && conversion.batch == NULL);
 }
 
 // enable the "Convert" button only if all required text fields have been filled
@@ -300,7 +349,7 @@ static void convert_button_enable_batch(GtkBuilder *builder)
     gint palettePathCount = gtk_entry_buffer_get_length(gtk_entry_get_buffer(GTK_ENTRY(gtk_builder_get_object(builder, "batchPaletteFileEntry"))));
 
     gtk_widget_set_sensitive(GTK_WIDGET(gtk_builder_get_object(builder, "batchConvertButton")),
-            inputPathCount > 0 && outputPathCount > 0 && palettePathCount > 0);
+            inputPathCount > 0 && outputPathCount > 0 && palettePathCount > 0 && conversion.batch == NULL);
 }
 
 static void text_inserted_single(GtkEntryBuffer *buffer, guint position, gchar *chars, guint count, gpointer data)
@@ -331,15 +380,38 @@ static void text_buffer_append(GtkTextBuffer *textBuffer, const gchar *text)
     gtk_text_buffer_insert(textBuffer, &endIter, text, -1);
 }
 
-// sets the vertical scroll position of a GtkScrollable to the bottom
-static void scroll_to_bottom(GtkScrollable *scrollable)
+// deletes lines from the start of a GtkTextBuffer until it has no more than maxLines
+static void text_buffer_trim(GtkTextBuffer *textBuffer, gint maxLines)
+{
+    gint excessLines = gtk_text_buffer_get_line_count(textBuffer) - maxLines;
+    GtkTextIter start, cut;
+
+    if (excessLines > 0)
+    {
+        gtk_text_buffer_get_start_iter(textBuffer, &start);
+        gtk_text_buffer_get_iter_at_line(textBuffer, &cut, excessLines);
+        gtk_text_buffer_delete(textBuffer, &start, &cut);
+    }
+}
+
+// Scrolls a text view to the end of its text. The scrolling happens once the view has laid out the new text, so
+// there's no need to run the main loop here.
+static void scroll_to_bottom(GtkTextView *textView)
 {
-    GtkAdjustment *adj = gtk_scrollable_get_vadjustment(scrollable);
-    gtk_adjustment_set_value(adj, gtk_adjustment_get_upper(adj));
+    GtkTextBuffer *textBuffer = gtk_text_view_get_buffer(textView);
+    GtkTextMark *endMark = gtk_text_buffer_get_mark(textBuffer, "end");
+    GtkTextIter endIter;
 
-    // run the main loop to actually apply the scrolling
-    while (gtk_events_pending())
-      gtk_main_iteration();
+    gtk_text_buffer_get_end_iter(textBuffer, &endIter);
+    if (endMark == NULL)
+    {
+        endMark = gtk_text_buffer_create_mark(textBuffer, "end", &endIter, FALSE);
+    }
+    else
+    {
+        gtk_text_buffer_move_mark(textBuffer, endMark, &endIter);
+    }
+    gtk_text_view_scroll_mark_onscreen(textView, endMark);
 }
 
 enum CustomOverwriteResponse {
@@ -347,199 +419,408 @@ enum CustomOverwriteResponse {
     RESPONSE_YES_ALL,
 };
 
-static bool convert_file(GtkBuilder *builder, const gchar *inputPath, const gchar *outputPath,
-                         const gchar *palettePath, bool batchMode, gint *response)
+// Asks whether an existing file should be overwritten, unless an earlier "to all" answer already settled it. Returns
+// true if the file should be written. If the user cancels, *response is set to GTK_RESPONSE_CANCEL. isMask says that
+// path is an alpha mask, which is only written if the image turns out to need one, so the question says as much.
+static bool confirm_overwrite(GtkBuilder *builder, const gchar *path, bool isMask, bool batchMode, gint *response)
 {
     GtkWindow *progressDialog = GTK_WINDOW(gtk_builder_get_object(builder, "progressDialog"));
-    GtkScrollable *progressTextView = GTK_SCROLLABLE(gtk_builder_get_object(builder, "progressTextView"));
-    GtkTextBuffer *progressLog = gtk_text_view_get_buffer(GTK_TEXT_VIEW(progressTextView));
 
-    if (!readPalette(palettePath))
+    if (!file_exists(path) || *response == RESPONSE_YES_ALL)
+    {
+        return true;
+    }
+    else if (*response == RESPONSE_NO_ALL)
     {
-        text_buffer_append(progressLog, "Failed to load palette from ");
-        text_buffer_append(progressLog, palettePath);
-        text_buffer_append(progressLog, "\n");
-        scroll_to_bottom(progressTextView);
         return false;
     }
 
-    SDL_Surface *img = readSourceImage(inputPath);
-    if (!img)
+    GtkWidget *dialog = gtk_message_dialog_new(progressDialog,
+            GTK_DIALOG_MODAL | GTK_DIALOG_DESTROY_WITH_PARENT,
+            GTK_MESSAGE_QUESTION,
+            batchMode ? GTK_BUTTONS_NONE : GTK_BUTTONS_YES_NO,
+            isMask ? "The file %s already exists. It is only replaced if the new image needs an alpha mask; "
+                     "otherwise it is left alone. Do you want to overwrite it?"
+                   : "The file %s already exists. Do you want to overwrite it?",
+            path);
+
+    if (batchMode)
     {
-        text_buffer_append(progressLog, "\nFailed to read image ");
-        text_buffer_append(progressLog, inputPath);
-        text_buffer_append(progressLog, "\n");
-        scroll_to_bottom(progressTextView);
-        SDL_FreeSurface(img);
-        return false;
+        gtk_dialog_add_buttons(GTK_DIALOG(dialog),
+                "_Cancel", GTK_RESPONSE_CANCEL,
+                "N_o to all", RESPONSE_NO_ALL,
+                "_No", GTK_RESPONSE_NO,
+                "Y_es to all", RESPONSE_YES_ALL,
+                "_Yes", GTK_RESPONSE_YES,
+                NULL);
+    }
+
+    *response = gtk_dialog_run(GTK_DIALOG(dialog));
+    gtk_widget_destroy(dialog);
+
+    return (*response == GTK_RESPONSE_YES || *response == RESPONSE_YES_ALL);
+}
+
+// returns the ID of the active item in the combo box called prefix + name, or NULL if nothing is selected
+static const gchar *selected_id(GtkBuilder *builder, const gchar *prefix, const gchar *name)
+{
+    gchar *comboBoxId = g_strconcat(prefix, name, NULL);
+    const gchar *id = gtk_combo_box_get_active_id(GTK_COMBO_BOX(gtk_builder_get_object(builder, comboBoxId)));
+    g_free(comboBoxId);
+    return id;
+}
+
+// Reads the conversion settings chosen on a tab. The widget IDs on the single file tab start with "single", and the
+// ones on the batch tab with "batch".
+static void selected_options(GtkBuilder *builder, const gchar *prefix, ConvertOptions *options)
+{
+    const gchar *profileName = selected_id(builder, prefix, "CompressionBox");
+    const gchar *metricName = selected_id(builder, prefix, "MetricBox");
+    const gchar *ditherName = selected_id(builder, prefix, "DitherBox");
+
+    defaultConvertOptions(options);
+    if (profileName) compressionProfileFromName(profileName, &options->compression);
+    if (metricName) colorMetricFromName(metricName, &options->metric);
+    if (ditherName) ditherModeFromName(ditherName, &options->dither);
+}
+
+static gboolean progress_idle(gpointer data);
+
+// Called on a worker thread whenever it has posted a message. Schedules one call to progress_idle() at a time, so a
+// burst of messages doesn't flood the main loop with idle callbacks.
+static void progress_notify(gpointer data)
+{
+    ConversionProgress *progress = (ConversionProgress*) data;
+
+    if (g_atomic_int_compare_and_exchange(&progress->idleQueued, 0, 1))
+    {
+        g_idle_add(progress_idle, progress);
+    }
+}
+
+// Shows the log text and progress that have built up since the last flush. While the input directory is still being
+// read, the progress is out of the files found so far.
+static void progress_flush(ConversionProgress *progress)
+{
+    if (progress->queuedCount > 0)
+    {
+        gtk_progress_bar_set_fraction(progress->progressBar, (gdouble) progress->doneCount / progress->queuedCount);
+    }
+    if (progress->pendingLog->len > 0)
+    {
+        text_buffer_append(progress->progressLog, progress->pendingLog->str);
+        g_string_truncate(progress->pendingLog, 0);
+        text_buffer_trim(progress->progressLog, LOG_MAX_LINES);
+        scroll_to_bottom(progress->progressTextView);
+    }
+}
+
+static gboolean progress_flush_timeout(gpointer data)
+{
+    ConversionProgress *progress = (ConversionProgress*) data;
+
+    progress->flushTimer = 0;
+    progress_flush(progress);
+    return G_SOURCE_REMOVE;
+}
+
+// makes sure that progress_flush() runs within LOG_FLUSH_INTERVAL_MS
+static void progress_schedule_flush(ConversionProgress *progress)
+{
+    if (progress->flushTimer == 0)
+    {
+        progress->flushTimer = g_timeout_add(LOG_FLUSH_INTERVAL_MS, progress_flush_timeout, progress);
+    }
+}
+
+// Adds text to the log at the next flush. If more builds up than the log would keep anyway, the oldest lines are
+// dropped.
+static void progress_log(ConversionProgress *progress, const gchar *text)
+{
+    GString *pendingLog = progress->pendingLog;
+
+    g_string_append(pendingLog, text);
+    if (pendingLog->len > LOG_MAX_PENDING_BYTES)
+    {
+        const gchar *cut = strchr(pendingLog->str + pendingLog->len - LOG_MAX_PENDING_BYTES, '\n');
+        g_string_erase(pendingLog, 0, cut ? cut + 1 - pendingLog->str : (gssize) pendingLog->len);
+    }
+    progress_schedule_flush(progress);
+}
+
+// Starts a conversion. The progress takes ownership of the palette.
+static void progress_init(ConversionProgress *progress, GtkBuilder *builder, Palette *palette,
+                          const ConvertOptions *options, bool batchMode)
+{
+    progress->builder = builder;
+    progress->palette = palette;
+    progress->progressBar = GTK_PROGRESS_BAR(gtk_builder_get_object(builder, "progressBar"));
+    progress->progressTextView = GTK_TEXT_VIEW(gtk_builder_get_object(builder, "progressTextView"));
+    progress->progressLog = gtk_text_view_get_buffer(progress->progressTextView);
+    progress->scan = NULL;
+    progress->outputDirPath = NULL;
+    progress->scanSource = 0;
+    progress->overwriteResponse = GTK_RESPONSE_NONE;
+    progress->queuedCount = 0;
+    progress->doneCount = 0;
+    progress->batchMode = batchMode;
+    progress->queueingDone = false;
+    progress->canceled = false;
+    progress->ok = true;
+    progress->cache = NULL;
+    progress->stats = NULL;
+    if (progress->pendingLog == NULL)
+    {
+        progress->pendingLog = g_string_new(NULL);
+    }
+    progress->batch = batchNew(palette, options, 0);
+    batchSetNotify(progress->batch, progress_notify, progress);
+
+    // no starting another conversion until this one is over
+    convert_button_enable_single(builder);
+    convert_button_enable_batch(builder);
+    gtk_widget_set_sensitive(GTK_WIDGET(gtk_builder_get_object(builder, "progressDialogCancelButton")), TRUE);
+}
+
+// Waits for the workers to exit, then frees everything the conversion was using.
+static void progress_free(ConversionProgress *progress)
+{
+    if (progress->scanSource)
+    {
+        g_source_remove(progress->scanSource);
+        progress->scanSource = 0;
     }
+    if (progress->scan)
+    {
+        batchScanFree(progress->scan);
+        progress->scan = NULL;
+    }
+    g_free(progress->outputDirPath);
+    progress->outputDirPath = NULL;
 
-    bool writeOutput = true;
-    if (file_exists(outputPath))
+    batchFree(progress->batch);
+    progress->batch = NULL;
+    freePalette(progress->palette);
+    progress->palette = NULL;
+
+    if (progress->cache)
     {
-        if (*response == RESPONSE_YES_ALL)
+        if (!conversionCacheSave(progress->cache))
         {
+            progress_log(progress, "Failed to save the list of converted files\n");
         }
-        else if (*response == RESPONSE_NO_ALL)
+        conversionCacheFree(progress->cache);
+        progress->cache = NULL;
+    }
+}
+
+// Reports the outcome once every queued file is done.
+static void progress_finish(ConversionProgress *progress)
+{
+    if (progress->stats)
+    {
+        gchar *summary = statsReportSummary(progress->stats);
+        gchar *statsPath = g_build_filename(progress->outputDirPath, STATS_FILENAME, NULL);
+        bool saved = statsReportSave(progress->stats, statsPath);
+        gchar *line = g_strdup_printf(saved ? "Saved the figures for each file to %s\n"
+                                            : "Failed to save statistics to %s\n", statsPath);
+        progress_log(progress, summary);
+        progress_log(progress, line);
+        g_free(line);
+        g_free(statsPath);
+        g_free(summary);
+        statsReportFree(progress->stats);
+        progress->stats = NULL;
+    }
+    progress_free(progress);
+
+    if (progress->canceled)
+    {
+        progress_log(progress, progress->batchMode ? "\nCanceled" : "\nAn error occurred");
+    }
+    else if (!progress->ok)
+    {
+        progress_log(progress, "\nAn error occurred");
+    }
+    else if (progress->queuedCount == 0)
+    {
+        progress_log(progress, "No input files\n");
+    }
+    else
+    {
+        progress_log(progress, "\nDone");
+    }
+
+    // the outcome is shown right away rather than at the next flush
+    g_source_remove(progress->flushTimer);
+    progress->flushTimer = 0;
+    progress_flush(progress);
+
+    convert_button_enable_single(progress->builder);
+    convert_button_enable_batch(progress->builder);
+    gtk_widget_set_sensitive(GTK_WIDGET(gtk_builder_get_object(progress->builder, "progressDialogCancelButton")), FALSE);
+}
+
+// Shows any log lines and progress updates that the workers have sent, and wraps up the conversion if they were the
+// last ones.
+static void progress_handle_messages(ConversionProgress *progress)
+{
+    BatchMessage *message;
+
+    if (progress->batch == NULL)
+    {
+        return;
+    }
+
+    while ((message = batchPopMessage(progress->batch, 0)))
+    {
+        if (progress->stats)
         {
-            writeOutput = false;
+            statsReportAdd(progress->stats, message);
         }
-        else
+        if (message->type == BATCH_MESSAGE_LOG)
         {
-            GtkWidget *dialog = gtk_message_dialog_new(progressDialog,
-                    GTK_DIALOG_MODAL | GTK_DIALOG_DESTROY_WITH_PARENT,
-                    GTK_MESSAGE_QUESTION,
-                    batchMode ? GTK_BUTTONS_NONE : GTK_BUTTONS_YES_NO,
-                    "The file %s already exists. Do you want to overwrite it?",
-                    outputPath);
-
-            if (batchMode)
-            {
-                gtk_dialog_add_buttons(GTK_DIALOG(dialog),
-                        "_Cancel", GTK_RESPONSE_CANCEL,
-                        "N_o to all", RESPONSE_NO_ALL,
-                        "_No", GTK_RESPONSE_NO,
-                        "Y_es to all", RESPONSE_YES_ALL,
-                        "_Yes", GTK_RESPONSE_YES,
-                        NULL);
-            }
-
-            *response = gtk_dialog_run(GTK_DIALOG(dialog));
-            gtk_widget_destroy(dialog);
+            progress_log(progress, message->text);
+        }
+        else if (message->type == BATCH_MESSAGE_FILE_DONE)
+        {
+            ++progress->doneCount;
+            progress_schedule_flush(progress);
 
-            writeOutput = (*response == GTK_RESPONSE_YES || *response == RESPONSE_YES_ALL);
-            if (*response == GTK_RESPONSE_CANCEL)
+            // stop the batch at the first error, like a sequential conversion would
+            if (!message->ok && progress->ok)
             {
-                SDL_FreeSurface(img);
-                return false;
+                progress->ok = false;
+                batchCancel(progress->batch);
             }
         }
+        batchFreeMessage(message);
     }
 
-    if (writeOutput)
+    if (progress->queueingDone && progress->doneCount == progress->queuedCount)
     {
-        if (!saveIndexedPNG(outputPath, img))
-        {
-            text_buffer_append(progressLog, "\nFailed to save image ");
-            text_buffer_append(progressLog, outputPath);
-            text_buffer_append(progressLog, "\n");
-            scroll_to_bottom(progressTextView);
-            SDL_FreeSurface(img);
-            return false;
-        }
-        else
-        {
-            text_buffer_append(progressLog, "Saved image ");
-            text_buffer_append(progressLog, outputPath);
-            text_buffer_append(progressLog, "\n");
-            scroll_to_bottom(progressTextView);
-        }
+        progress_finish(progress);
     }
-    else
+}
+
+static gboolean progress_idle(gpointer data)
+{
+    ConversionProgress *progress = (ConversionProgress*) data;
+
+    // cleared before reading, so a message posted while this runs schedules another call
+    g_atomic_int_set(&progress->idleQueued, 0);
+    progress_handle_messages(progress);
+    return G_SOURCE_REMOVE;
+}
+
+// Settles any overwrite conflicts for a conversion's output files, then hands it to the workers. Returns false if the
+// user canceled.
+static bool progress_queue_file(ConversionProgress *progress, const gchar *inputPath, const gchar *outputPath,
+                                gint *response)
+{
+    GtkBuilder *builder = progress->builder;
+    gchar *maskPath = maskPathForOutput(outputPath);
+    ConversionCache *cache = progress->cache;
+    bool writeOutput = false, writeMask = false;
+
+    // An output that another file in this conversion already writes is reported as an error by batchPush(), so
+    // there's nothing to ask about. Otherwise, files written by an earlier conversion that nobody has touched since
+    // are replaced without asking.
+    if (batchOutputOwner(progress->batch, outputPath) == NULL)
     {
-        text_buffer_append(progressLog, "Not overwriting ");
-        text_buffer_append(progressLog, outputPath);
-        text_buffer_append(progressLog, "\n");
-        scroll_to_bottom(progressTextView);
+        writeOutput = (cache && conversionCacheOwnsFile(cache, outputPath)) ||
+                      confirm_overwrite(builder, outputPath, false, progress->batchMode, response);
+        writeMask = (*response != GTK_RESPONSE_CANCEL) &&
+                    ((cache && conversionCacheOwnsFile(cache, maskPath)) ||
+                     confirm_overwrite(builder, maskPath, true, progress->batchMode, response));
     }
+    g_free(maskPath);
 
-    if (img->format->Amask)
+    if (*response == GTK_RESPONSE_CANCEL)
     {
-        if (alphaType(img) == ALPHA_MASK_NEEDED)
-        {
-            // make a mask filename
-            size_t outputPathLength = strlen(outputPath);
-            size_t maskPathLength = outputPathLength + 6; // 5 bytes for "-mask"
-            gchar *maskPath = malloc(maskPathLength + 1);
-            memcpy(maskPath, outputPath, outputPathLength - 4); // copy everything up to ".png" extension
-            snprintf(maskPath + outputPathLength - 4, 10, "-mask.png");
-            printf("mask path: %s\n", maskPath);
-
-            bool writeMask = true;
-            if (file_exists(maskPath))
-            {
-                if (*response == RESPONSE_YES_ALL)
-                {
-                }
-                else if (*response == RESPONSE_NO_ALL)
-                {
-                    writeMask = false;
-                }
-                else
-                {
-                    GtkWidget *dialog = gtk_message_dialog_new(progressDialog,
-                        GTK_DIALOG_MODAL | GTK_DIALOG_DESTROY_WITH_PARENT,
-                        GTK_MESSAGE_QUESTION,
-                        batchMode ? GTK_BUTTONS_NONE : GTK_BUTTONS_YES_NO,
-                        "The file %s already exists. Do you want to overwrite it?",
-                        maskPath);
-
-                    if (batchMode)
-                    {
-                        gtk_dialog_add_buttons(GTK_DIALOG(dialog),
-                                "_Cancel", GTK_RESPONSE_CANCEL,
-                                "N_o to all", RESPONSE_NO_ALL,
-                                "_No", GTK_RESPONSE_NO,
-                                "Y_es to all", RESPONSE_YES_ALL,
-                                "_Yes", GTK_RESPONSE_YES,
-                                NULL);
-                    }
-
-                    *response = gtk_dialog_run(GTK_DIALOG(dialog));
-                    gtk_widget_destroy(dialog);
-
-                    writeMask = (*response == GTK_RESPONSE_YES || *response == RESPONSE_YES_ALL);
-                    if (*response == GTK_RESPONSE_CANCEL)
-                    {
-                        SDL_FreeSurface(img);
-                        free(maskPath);
-                        return false;
-                    }
-                }
-            }
+        return false;
+    }
 
-            if (writeMask)
-            {
-                if (!saveMask(maskPath, img))
-                {
-                    text_buffer_append(progressLog, "\nFailed to save alpha mask ");
-                    text_buffer_append(progressLog, maskPath);
-                    text_buffer_append(progressLog, "\n");
-                    scroll_to_bottom(progressTextView);
-                    free(maskPath);
-                    SDL_FreeSurface(img);
-                    return false;
-                }
-                else
-                {
-                    text_buffer_append(progressLog, "Saved alpha mask ");
-                    text_buffer_append(progressLog, maskPath);
-                    text_buffer_append(progressLog, "\n");
-                    scroll_to_bottom(progressTextView);
-                }
-            }
-            else
-            {
-                text_buffer_append(progressLog, "Not overwriting ");
-                text_buffer_append(progressLog, maskPath);
-                text_buffer_append(progressLog, "\n");
-                scroll_to_bottom(progressTextView);
-            }
+    batchPush(progress->batch, inputPath, outputPath, writeOutput, writeMask);
+    ++progress->queuedCount;
+    return true;
+}
 
-            free(maskPath);
+// Called once everything has been queued. From here on, the idle callbacks take care of the rest of the conversion.
+static void progress_queueing_done(ConversionProgress *progress, bool canceled)
+{
+    if (canceled)
+    {
+        progress->canceled = true;
+        batchCancel(progress->batch);
+    }
+    progress->queueingDone = true;
+    progress_handle_messages(progress);
+}
+
+// Queues the files that the input directory scan finds, a few milliseconds' worth at a time, so that the workers start
+// on the first files right away and the UI stays responsive while a big tree is read. Finishes the queueing once the
+// scan runs out of files, or when the conversion is canceled or a file fails.
+static gboolean progress_scan_idle(gpointer data)
+{
+    ConversionProgress *progress = (ConversionProgress*) data;
+    gint64 deadline = g_get_monotonic_time() + SCAN_SLICE_US;
+    gchar *inputPath, *relativePath;
+    bool canceled = false;
+
+    while (progress->ok && !progress->canceled && !canceled)
+    {
+        if (!batchScanNext(progress->scan, &inputPath, &relativePath))
+        {
+            break;
         }
-        else
+
+        // the results are left out of the rest of the scan in case the output directory is inside the input one
+        gchar *outputPath = outputPathForInput(progress->outputDirPath, relativePath);
+        gchar *maskPath = maskPathForOutput(outputPath);
+        batchScanSkip(progress->scan, outputPath);
+        batchScanSkip(progress->scan, maskPath);
+        g_free(maskPath);
+
+        // settle overwrite conflicts here on the UI thread, then let the workers do the actual conversion
+        canceled = !progress_queue_file(progress, inputPath, outputPath, &progress->overwriteResponse);
+        g_free(inputPath);
+        g_free(relativePath);
+        g_free(outputPath);
+
+        if (!canceled && g_get_monotonic_time() >= deadline)
         {
-            printf("no alpha mask needed (simple alpha channel)\n");
+            return G_SOURCE_CONTINUE;
         }
     }
-    else
+
+    progress->scanSource = 0;
+    batchScanFree(progress->scan);
+    progress->scan = NULL;
+    progress_queueing_done(progress, canceled);
+    return G_SOURCE_REMOVE;
+}
+
+// Stops the conversion. Files that are partly converted are abandoned at the next row, and nothing more is saved.
+// The idle callbacks report the outcome once the workers have stopped.
+static void progress_cancel(ConversionProgress *progress)
+{
+    if (progress->batch && !progress->canceled)
     {
-        printf("no alpha mask needed (source has no alpha channel)\n");
+        progress->canceled = true;
+        batchCancel(progress->batch);
+        progress_log(progress, "\nCanceling...\n");
     }
+}
 
-    SDL_FreeSurface(img);
-    return true;
+// Cancels the conversion, if one is running, and waits for the file that each worker is on to finish.
+static void progress_abort(ConversionProgress *progress)
+{
+    if (progress->batch)
+    {
+        batchCancel(progress->batch);
+        progress_free(progress);
+    }
 }
 
 static void convert_single(GtkWidget *widget, gpointer data)
@@ -555,6 +836,16 @@ static void convert_single(GtkWidget *widget, gpointer data)
     gtk_progress_bar_set_fraction(progressBar, 0.0);
     gtk_widget_show_all(progressDialog);
 
+    Palette *palette = readPalette(palettePath);
+    if (!palette)
+    {
+        text_buffer_append(progressLog, "Failed to load palette from ");
+        text_buffer_append(progressLog, palettePath);
+        text_buffer_append(progressLog, "\n");
+        text_buffer_append(progressLog, "\nAn error occurred");
+        return;
+    }
+
     // add a ".png" suffix to the output path if it doesn't already have one
     gchar *outputPath;
     size_t outputPathLength;
@@ -571,16 +862,12 @@ static void convert_single(GtkWidget *widget, gpointer data)
         outputPathLength = strlen(outputPath);
     }
 
+    ConvertOptions options;
+    selected_options(builder, "single", &options);
+    progress_init(&conversion, builder, palette, &options, false);
     gint response = GTK_RESPONSE_NONE;
-    if (convert_file(builder, inputPath, outputPath, palettePath, false, &response))
-    {
-        gtk_progress_bar_set_fraction(progressBar, 1.0);
-        text_buffer_append(progressLog, "\nDone");
-    }
-    else
-    {
-        text_buffer_append(progressLog, "\nAn error occurred");
-    }
+    bool canceled = !progress_queue_file(&conversion, inputPath, outputPath, &response);
+    progress_queueing_done(&conversion, canceled);
 
     free(outputPath);
 }
@@ -589,124 +876,68 @@ static void convert_batch(GtkWidget *widget, gpointer data)
 {
     GtkBuilder *builder = (GtkBuilder*) data;
     GtkWidget *progressDialog = GTK_WIDGET(gtk_builder_get_object(builder, "progressDialog"));
-    GtkScrollable *progressTextView = GTK_SCROLLABLE(gtk_builder_get_object(builder, "progressTextView"));
-    GtkTextBuffer *progressLog = gtk_text_view_get_buffer(GTK_TEXT_VIEW(progressTextView));
+    GtkTextView *progressTextView = GTK_TEXT_VIEW(gtk_builder_get_object(builder, "progressTextView"));
+    GtkTextBuffer *progressLog = gtk_text_view_get_buffer(progressTextView);
     GtkProgressBar *progressBar = GTK_PROGRESS_BAR(gtk_builder_get_object(builder, "progressBar"));
     GtkComboBoxText *extensionBox = GTK_COMBO_BOX_TEXT(gtk_builder_get_object(builder, "batchInputFileExtensionBox"));
+    GtkToggleButton *recursiveCheck = GTK_TOGGLE_BUTTON(gtk_builder_get_object(builder, "batchRecursiveCheck"));
+    GtkToggleButton *skipUnchangedCheck = GTK_TOGGLE_BUTTON(gtk_builder_get_object(builder, "batchSkipUnchangedCheck"));
+    GtkToggleButton *statsCheck = GTK_TOGGLE_BUTTON(gtk_builder_get_object(builder, "batchStatsCheck"));
 
-    gchar *inputExtension = gtk_combo_box_text_get_active_text(extensionBox);
+    // the extension box has single extensions like ".png" and lists like ".png, .gif, .pcx, .bmp"
+    gchar *extensionList = gtk_combo_box_text_get_active_text(extensionBox);
+    gchar **extensions = parseExtensionList(extensionList);
     const gchar *inputDirPath = gtk_entry_get_text(GTK_ENTRY(gtk_builder_get_object(builder, "batchInputDirEntry")));
-    GDir *inputDir = g_dir_open(inputDirPath, 0, NULL);
     const gchar *outputDirPath = gtk_entry_get_text(GTK_ENTRY(gtk_builder_get_object(builder, "batchOutputDirEntry")));
     const gchar *palettePath = gtk_entry_get_text(GTK_ENTRY(gtk_builder_get_object(builder, "batchPaletteFileEntry")));
 
     gtk_progress_bar_set_fraction(progressBar, 0.0);
     gtk_widget_show_all(progressDialog);
 
-    struct InputName {
-        gchar *name;
-        struct InputName *next;
-    };
-    struct InputName *nameList = NULL, *cur = NULL;
-    unsigned int numInputFiles = 0;
-    const gchar *name;
-    while ((name = g_dir_read_name(inputDir)))
-    {
-        if (g_str_has_suffix(name, inputExtension))
-        {
-            struct InputName *nameNode = malloc(sizeof(struct InputName));
-            nameNode->name = strdup(name);
-            nameNode->next = NULL;
-
-            if (nameList == NULL)
-            {
-                nameList = nameNode;
-            }
-
-            if (cur)
-            {
-                cur->next = nameNode;
-            }
-            cur = nameNode;
-            ++numInputFiles;
-        }
-    }
-    g_dir_close(inputDir);
-    g_free(inputExtension);
-
-    bool ok = true;
-    gint response = GTK_RESPONSE_NONE;
-    unsigned int convertedCount = 0;
-    cur = nameList;
-    while (cur != NULL)
-    {
-        name = cur->name;
-
-        // make full input path
-        size_t inputPathLength = strlen(inputDirPath) + strlen(name) + 1;
-        gchar *inputPath = malloc(inputPathLength + 1);
-        snprintf(inputPath, inputPathLength + 1, "%s/%s", inputDirPath, name);
-        printf("input file: %s\n", inputPath);
-
-        // make full output path
-        size_t outputPathLength = strlen(outputDirPath) + strlen(name) + 1;
-        gchar *outputPath = malloc(outputPathLength + 1);
-        snprintf(outputPath, outputPathLength + 1, "%s/%s", outputDirPath, name);
-
-        // replace output extension with ".png"
-        // this method works because the input filename is guaranteed to end with a 3-letter extension
-        memcpy(&outputPath[outputPathLength - 4], ".png", 4);
-        printf("output file: %s\n", outputPath);
-
-        // do the actual conversion
-        ok = convert_file(builder, inputPath, outputPath, palettePath, true, &response);
-        free(inputPath);
-        free(outputPath);
-
-        if (response == GTK_RESPONSE_CANCEL || !ok)
-        {
-            break;
-        }
-
-        // update progress bar
-        ++convertedCount;
-        gtk_progress_bar_set_fraction(progressBar, (gdouble) convertedCount / numInputFiles);
-
-        cur = cur->next;
-    }
-
-    // Free the input name list
-    while (nameList != NULL)
-    {
-        struct InputName *next = nameList->next;
-        free(nameList->name);
-        free(nameList);
-        nameList = next;
-    }
+    BatchScan *scan = batchScanNew(inputDirPath, extensions, gtk_toggle_button_get_active(recursiveCheck) ? -1 : 0);
+    g_strfreev(extensions);
+    g_free(extensionList);
 
-    if (response == GTK_RESPONSE_CANCEL)
-    {
-        text_buffer_append(progressLog, "\nCanceled");
-        scroll_to_bottom(progressTextView);
-    }
-    else if (!ok)
+    // The palette is loaded once and shared by all of the worker threads.
+    Palette *palette = scan ? readPalette(palettePath) : NULL;
+    if (scan == NULL)
     {
+        text_buffer_append(progressLog, "Failed to open input directory ");
+        text_buffer_append(progressLog, inputDirPath);
+        text_buffer_append(progressLog, "\n");
         text_buffer_append(progressLog, "\nAn error occurred");
         scroll_to_bottom(progressTextView);
     }
-    else if (numInputFiles == 0)
+    else if (palette == NULL)
     {
-        text_buffer_append(progressLog, "No input files\n");
+        text_buffer_append(progressLog, "Failed to load palette from ");
+        text_buffer_append(progressLog, palettePath);
+        text_buffer_append(progressLog, "\n");
+        text_buffer_append(progressLog, "\nAn error occurred");
         scroll_to_bottom(progressTextView);
+        batchScanFree(scan);
     }
     else
     {
-        gtk_progress_bar_set_fraction(progressBar, 1.0);
-        text_buffer_append(progressLog, "\nDone");
-        scroll_to_bottom(progressTextView);
-    }
+        ConvertOptions options;
+        selected_options(builder, "batch", &options);
+        progress_init(&conversion, builder, palette, &options, true);
+        if (gtk_toggle_button_get_active(skipUnchangedCheck))
+        {
+            conversion.cache = conversionCacheOpen(outputDirPath);
+            batchUseCache(conversion.batch, conversion.cache);
+        }
+        if (gtk_toggle_button_get_active(statsCheck))
+        {
+            conversion.stats = statsReportNew();
+            batchCollectStats(conversion.batch);
+        }
 
-    scroll_to_bottom(progressTextView);
+        // the files are queued from the main loop as the scan finds them
+        conversion.scan = scan;
+        conversion.outputDirPath = g_strdup(outputDirPath);
+        conversion.scanSource = g_idle_add(progress_scan_idle, &conversion);
+    }
 }
 
 static void show_help_single(GtkWidget *widget, gpointer data)
@@ -749,13 +980,28 @@ static void on_show_progress_dialog(GtkWidget *widget, gpointer data)
     gtk_text_buffer_delete(progressLog, &start, &end);
 }
 
+static void cancel_conversion(GtkWidget *widget, gpointer data)
+{
+    progress_cancel(&conversion);
+}
+
+// Closing the progress dialog while a conversion is running cancels it.
 static void hide_progress_dialog(GtkWidget *widget, gpointer data)
 {
     GtkBuilder *builder = (GtkBuilder*) data;
     GtkWidget *progressDialog = GTK_WIDGET(gtk_builder_get_object(builder, "progressDialog"));
+
+    progress_cancel(&conversion);
     gtk_widget_hide(progressDialog);
 }
 
+// The progress dialog is reused for every conversion, so closing it from the title bar only hides it.
+static gboolean on_delete_progress_dialog(GtkWidget *widget, GdkEvent *event, gpointer data)
+{
+    hide_progress_dialog(widget, data);
+    return TRUE;
+}
+
 // Glade's support for "About" dialogs is lacking, so do this manually.
 static void show_about_dialog(GtkWidget *widget, gpointer data)
 {
@@ -763,7 +1009,7 @@ static void show_about_dialog(GtkWidget *widget, gpointer data)
     GtkAboutDialog *aboutDialog = GTK_ABOUT_DIALOG(gtk_about_dialog_new());
 
     gtk_about_dialog_set_program_name(aboutDialog, "PalApply v2");
-    gtk_about_dialog_set_version(aboutDialog, "v2.0.3");
+    gtk_about_dialog_set_version(aboutDialog, "v" PALAPPLY_VERSION);
     gtk_about_dialog_set_copyright(aboutDialog, "Copyright (c) 2010-2019 Bryan Cain");
     gtk_about_dialog_set_license_type(aboutDialog, GTK_LICENSE_GPL_3_0);
 #ifdef _WIN32
@@ -788,6 +1034,12 @@ int main(int argc, char **argv)
     GObject *button;
     GError *error = NULL;
 
+    // Any arguments mean we were started from the command line, so convert without showing the GUI.
+    if (argc > 1)
+    {
+        return commandLineMain(argc, argv);
+    }
+
     gtk_init(&argc, &argv);
 
     /* Construct a GtkBuilder instance and load our UI description */
@@ -845,11 +1097,15 @@ int main(int argc, char **argv)
     button = gtk_builder_get_object(builder, "batchAboutButton");
     g_signal_connect(button, "clicked", G_CALLBACK(show_about_dialog), builder);
 
+    button = gtk_builder_get_object(builder, "progressDialogCancelButton");
+    g_signal_connect(button, "clicked", G_CALLBACK(cancel_conversion), builder);
+
     button = gtk_builder_get_object(builder, "progressDialogCloseButton");
     g_signal_connect(button, "clicked", G_CALLBACK(hide_progress_dialog), builder);
 
     GObject *dialog = gtk_builder_get_object(builder, "progressDialog");
     g_signal_connect(dialog, "show", G_CALLBACK(on_show_progress_dialog), builder);
+    g_signal_connect(dialog, "delete-event", G_CALLBACK(on_delete_progress_dialog), builder);
 
     // Only enable the "convert" button when all of the requisite text fields have text in them.
     convert_button_enable_single(builder);
@@ -895,6 +1151,9 @@ int main(int argc, char **argv)
     gtk_widget_show_all(GTK_WIDGET(window));
     gtk_main();
 
+    // don't leave workers writing files after the window is gone
+    progress_abort(&conversion);
+
     g_free(lastDirectory);
     lastDirectory = NULL;
 
@@ -42,7 +42,7 @@ static const char *batchHelpText =
     "\n"
     "<b>How to Use</b>\n"
     "\n"
-    "The \"input directory\" field holds the directory containing all of the files you wish to convert to indexed mode. In the \"extension of input files\" box, select from the list the file extension of the images you wish to convert.\n"
+    "The \"input directory\" field holds the directory containing all of the files you wish to convert to indexed mode. In the \"extension of input files\" box, select from the list the file extension of the images you wish to convert, or the last entry to convert images of every supported format at once. Check \"Include subfolders\" to also convert the images in all of the folders inside the input directory; their results are saved in folders of the same names inside the output directory, which are created as needed.\n"
     "\n"
     "The \"output directory\" field holds the directory that the converted files will be saved to. Output files are always in PNG format, regardless of the input file format.\n"
     "\n"
@@ -20,19 +20,31 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <string.h>
+#include <errno.h>
 #include <assert.h>
+#include <math.h>
 #include <png.h>
 #include <zlib.h>
 #include "SDL_image.h"
 #include "palapply.h"
 
-#ifndef _WIN32
+#ifdef _WIN32
+#include <windows.h>
+#else
 #define stricmp strcasecmp
 #endif
 
+// The vectorized palette search is only built for x86 with GCC-style target attributes, so that it can be selected at
+// runtime without compiling the whole program for a newer CPU.
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#define HAVE_SIMD_SEARCH 1
+#include <immintrin.h>
+#endif
+
 typedef struct {
     uint32_t w;
     uint32_t h;
@@ -40,344 +52,2638 @@ typedef struct {
     uint32_t *pixels;
 } Image32;
 
-static png_color pal[256];
-static int pal_ncolors; // number of colors in palette (1-256)
+// The RGB cube is split into SEARCH_GRID_SIZE^3 equal cells for nearestColorGrid().
+#define SEARCH_GRID_BITS 4
+#define SEARCH_GRID_SIZE (1 << SEARCH_GRID_BITS)
+#define SEARCH_GRID_CELLS (SEARCH_GRID_SIZE * SEARCH_GRID_SIZE * SEARCH_GRID_SIZE)
+#define SEARCH_GRID_CELL_WIDTH (256 >> SEARCH_GRID_BITS)
+
+// Finds the palette index nearest to an RGB color by some measure; see nearestColor().
+typedef uint8_t (*NearestColorFunc)(const Palette *pal, uint8_t r, uint8_t g, uint8_t b, bool skipTransparent);
+
+// A palette is loaded once and then only read from, so a single Palette can be shared by any number of conversions.
+struct Palette {
+    png_color colors[256];
+    int ncolors; // number of colors in palette (1-256)
+
+    // The colors split into one array per channel for the vectorized search, with laneCount rounded up to a multiple
+    // of 16. Padding entries, and entry 0 in the second copy of the red channel (used when the transparent color has
+    // to be skipped), hold an out-of-range value that makes them too far away to ever be the nearest color.
+    int16_t laneRed[2][256];
+    int16_t laneGreen[256];
+    int16_t laneBlue[256];
+    int laneCount;
+    NearestColorFunc scan;   // the fastest search of the whole palette the CPU supports
+    NearestColorFunc search; // the search used for COLOR_METRIC_RGB
+
+    // The search grid for nearestColorGrid(), one for each value of skipTransparent: the entries that can be nearest
+    // to some color in each cell, in increasing order. The list for cell c runs from gridEntries[gridStart[c]] up to
+    // gridEntries[gridStart[c + 1]]. Not used if the grid couldn't be allocated.
+    uint32_t gridStart[2][SEARCH_GRID_CELLS + 1];
+    uint8_t *gridEntries[2];
+    uint32_t gridMaxList; // cells with longer lists than this are left to scan, which is faster for them
+
+    // For the perceptual metrics: each sRGB level in linear light, and the colors converted to CIELAB and Oklab.
+    float linear[256];
+    float lab[256][3];
+    float oklab[256][3];
+};
+
+// Direct-mapped cache of nearest-color results, keyed by RGB value. Source images tend to reuse the same few hundred
+// colors many times over, so this saves nearly all of the palette searches on typical sprites.
+#define NEAREST_CACHE_BITS 16
+#define NEAREST_CACHE_SIZE (1 << NEAREST_CACHE_BITS)
 
-static bool readPaletteFromACT(const char *path)
+typedef struct {
+    uint32_t keys[NEAREST_CACHE_SIZE]; // 0 for an empty slot, otherwise the RGB value with bit 31 set
+    uint8_t values[NEAREST_CACHE_SIZE];
+    NearestColorFunc search; // the search for the conversion's ColorMetric
+    Uint64 lookups;  // for ConversionStats
+    Uint64 searches;
+} NearestColorCache;
+
+// Adds the time since *mark to a stage of stats and moves *mark up to now. Does nothing if stats is NULL, which is how
+// conversions run unless someone asked for statistics.
+static void stageLap(ConversionStats *stats, ConversionStage stage, Uint64 *mark)
 {
-    FILE *fp = fopen(path, "rb");
+    if (stats)
+    {
+        Uint64 now = SDL_GetPerformanceCounter();
+        stats->ticks[stage] += now - *mark;
+        *mark = now;
+    }
+}
 
-    if (fp == NULL)
+static Uint64 stageMark(const ConversionStats *stats)
+{
+    return stats ? SDL_GetPerformanceCounter() : 0;
+}
+
+static void addCacheStats(ConversionStats *stats, const NearestColorCache *cache)
+{
+    if (stats && cache)
     {
-        return false;
+        stats->colorLookups += cache->lookups;
+        stats->colorSearches += cache->searches;
     }
+}
 
-    for (int i = 0; i < 256; i++)
+// returns the index of the palette color closest to (r,g,b); ties go to the lowest index
+static uint8_t nearestColor(const Palette *pal, uint8_t r, uint8_t g, uint8_t b, bool skipTransparent)
+{
+    int j;
+    int nearest = 1;
+    int nearest_dist_sq = 9999999;
+    /* If the source has an alpha mask, don't use the transparent color (0) for any
+     * pixels that aren't completely transparent. */
+    for (j = skipTransparent ? 1 : 0; j < pal->ncolors; j++)
     {
-        if (fread(&pal[i].red, 1, 1, fp) != 1 ||
-            fread(&pal[i].green, 1, 1, fp) != 1 ||
-            fread(&pal[i].blue, 1, 1, fp) != 1)
+        int rdist = r - pal->colors[j].red;
+        int gdist = g - pal->colors[j].green;
+        int bdist = b - pal->colors[j].blue;
+        int dist_sq = rdist*rdist + gdist*gdist + bdist*bdist;
+        if (dist_sq < nearest_dist_sq)
         {
-            fclose(fp);
-            return false;
+            nearest_dist_sq = dist_sq;
+            nearest = j;
         }
     }
+    return nearest;
+}
 
-    pal_ncolors = 256;
-    fclose(fp);
-    return true;
+#define EXCLUDED_LANE_VALUE 16384
+#define MAX_DIST_SQ (3 * 255 * 255)
+
+#ifdef HAVE_SIMD_SEARCH
+// SSE2 version of nearestColor(). Computes the distances to 8 palette entries at a time, keeping the best distance and
+// index separately in each 32-bit lane. Each lane sees its entries in increasing order and only replaces its best on
+// a strictly smaller distance, and the final reduction prefers the lowest index among equal distances, so the result
+// is always the same as nearestColor().
+__attribute__((target("sse2")))
+static uint8_t nearestColorSSE2(const Palette *pal, uint8_t r, uint8_t g, uint8_t b, bool skipTransparent)
+{
+    const int16_t *laneRed = pal->laneRed[skipTransparent];
+    __m128i vr = _mm_set1_epi16(r), vg = _mm_set1_epi16(g), vb = _mm_set1_epi16(b), zero = _mm_setzero_si128();
+    __m128i bestDist = _mm_set1_epi32(INT32_MAX), bestIndex = zero;
+    __m128i indexLo = _mm_setr_epi32(0, 1, 2, 3), indexHi = _mm_setr_epi32(4, 5, 6, 7), step = _mm_set1_epi32(8);
+
+    for (int j = 0; j < pal->laneCount; j += 8)
+    {
+        __m128i dr = _mm_sub_epi16(_mm_loadu_si128((const __m128i*) &laneRed[j]), vr);
+        __m128i dg = _mm_sub_epi16(_mm_loadu_si128((const __m128i*) &pal->laneGreen[j]), vg);
+        __m128i db = _mm_sub_epi16(_mm_loadu_si128((const __m128i*) &pal->laneBlue[j]), vb);
+        __m128i rgLo = _mm_unpacklo_epi16(dr, dg), rgHi = _mm_unpackhi_epi16(dr, dg);
+        __m128i bLo = _mm_unpacklo_epi16(db, zero), bHi = _mm_unpackhi_epi16(db, zero);
+        __m128i distLo = _mm_add_epi32(_mm_madd_epi16(rgLo, rgLo), _mm_madd_epi16(bLo, bLo));
+        __m128i distHi = _mm_add_epi32(_mm_madd_epi16(rgHi, rgHi), _mm_madd_epi16(bHi, bHi));
+
+        __m128i closer = _mm_cmplt_epi32(distLo, bestDist);
+        bestDist = _mm_or_si128(_mm_and_si128(closer, distLo), _mm_andnot_si128(closer, bestDist));
+        bestIndex = _mm_or_si128(_mm_and_si128(closer, indexLo), _mm_andnot_si128(closer, bestIndex));
+        closer = _mm_cmplt_epi32(distHi, bestDist);
+        bestDist = _mm_or_si128(_mm_and_si128(closer, distHi), _mm_andnot_si128(closer, bestDist));
+        bestIndex = _mm_or_si128(_mm_and_si128(closer, indexHi), _mm_andnot_si128(closer, bestIndex));
+
+        indexLo = _mm_add_epi32(indexLo, step);
+        indexHi = _mm_add_epi32(indexHi, step);
+    }
+
+    int32_t dists[4], indices[4];
+    _mm_storeu_si128((__m128i*) dists, bestDist);
+    _mm_storeu_si128((__m128i*) indices, bestIndex);
+    int nearest = indices[0], nearestDist = dists[0];
+    for (int k = 1; k < 4; k++)
+    {
+        if (dists[k] < nearestDist || (dists[k] == nearestDist && indices[k] < nearest))
+        {
+            nearestDist = dists[k];
+            nearest = indices[k];
+        }
+    }
+
+    // every entry was excluded (a 1-color palette with a transparent source); match what nearestColor() does
+    return nearestDist > MAX_DIST_SQ ? 1 : nearest;
 }
 
-static bool readPaletteFromImage(const char *path)
+// AVX2 version of nearestColorSSE2(), 16 palette entries at a time. The 256-bit unpack instructions work within each
+// 128-bit half, so the low half of the vector holds entries 0-3 and 8-11 and the high half holds 4-7 and 12-15.
+__attribute__((target("avx2")))
+static uint8_t nearestColorAVX2(const Palette *pal, uint8_t r, uint8_t g, uint8_t b, bool skipTransparent)
 {
-    SDL_Surface *image = IMG_Load(path);
-    if (!image)
+    const int16_t *laneRed = pal->laneRed[skipTransparent];
+    __m256i vr = _mm256_set1_epi16(r), vg = _mm256_set1_epi16(g), vb = _mm256_set1_epi16(b);
+    __m256i zero = _mm256_setzero_si256();
+    __m256i bestDist = _mm256_set1_epi32(INT32_MAX), bestIndex = zero;
+    __m256i indexLo = _mm256_setr_epi32(0, 1, 2, 3, 8, 9, 10, 11), indexHi = _mm256_setr_epi32(4, 5, 6, 7, 12, 13, 14, 15);
+    __m256i step = _mm256_set1_epi32(16);
+
+    for (int j = 0; j < pal->laneCount; j += 16)
     {
-        printf("Error: %s\n", SDL_GetError());
-        return false;
+        __m256i dr = _mm256_sub_epi16(_mm256_loadu_si256((const __m256i*) &laneRed[j]), vr);
+        __m256i dg = _mm256_sub_epi16(_mm256_loadu_si256((const __m256i*) &pal->laneGreen[j]), vg);
+        __m256i db = _mm256_sub_epi16(_mm256_loadu_si256((const __m256i*) &pal->laneBlue[j]), vb);
+        __m256i rgLo = _mm256_unpacklo_epi16(dr, dg), rgHi = _mm256_unpackhi_epi16(dr, dg);
+        __m256i bLo = _mm256_unpacklo_epi16(db, zero), bHi = _mm256_unpackhi_epi16(db, zero);
+        __m256i distLo = _mm256_add_epi32(_mm256_madd_epi16(rgLo, rgLo), _mm256_madd_epi16(bLo, bLo));
+        __m256i distHi = _mm256_add_epi32(_mm256_madd_epi16(rgHi, rgHi), _mm256_madd_epi16(bHi, bHi));
+
+        __m256i closer = _mm256_cmpgt_epi32(bestDist, distLo);
+        bestDist = _mm256_blendv_epi8(bestDist, distLo, closer);
+        bestIndex = _mm256_blendv_epi8(bestIndex, indexLo, closer);
+        closer = _mm256_cmpgt_epi32(bestDist, distHi);
+        bestDist = _mm256_blendv_epi8(bestDist, distHi, closer);
+        bestIndex = _mm256_blendv_epi8(bestIndex, indexHi, closer);
+
+        indexLo = _mm256_add_epi32(indexLo, step);
+        indexHi = _mm256_add_epi32(indexHi, step);
     }
-    else if (!image->format->palette)
+
+    int32_t dists[8], indices[8];
+    _mm256_storeu_si256((__m256i*) dists, bestDist);
+    _mm256_storeu_si256((__m256i*) indices, bestIndex);
+    int nearest = indices[0], nearestDist = dists[0];
+    for (int k = 1; k < 8; k++)
     {
-        printf("Error: palette image %s is not indexed\n", path);
-        SDL_FreeSurface(image);
-        return false;
+        if (dists[k] < nearestDist || (dists[k] == nearestDist && indices[k] < nearest))
+        {
+            nearestDist = dists[k];
+            nearest = indices[k];
+        }
     }
-    else
+
+    return nearestDist > MAX_DIST_SQ ? 1 : nearest;
+}
+#endif
+
+// Squared distances from a palette channel value to the nearest and furthest values in [low, low + cell width).
+static void cellChannelDistances(int value, int low, int *nearSq, int *farSq)
+{
+    int high = low + SEARCH_GRID_CELL_WIDTH - 1;
+    int nearDist = value < low ? low - value : (value > high ? value - high : 0);
+    int farDist = value - low > high - value ? value - low : high - value;
+    *nearSq += nearDist * nearDist;
+    *farSq += farDist * farDist;
+}
+
+// Builds the candidate lists for nearestColorGrid(). No color in a cell can be further from its nearest entry than the
+// entry whose furthest point of the cell is closest, so only the entries whose nearest point of the cell is within
+// that distance can ever win there. Listing them in index order keeps the tie-breaking of nearestColor(). Returns
+// false if out of memory.
+static bool prepareSearchGrid(Palette *pal)
+{
+    for (int skip = 0; skip < 2; skip++)
     {
-        pal_ncolors = image->format->palette->ncolors;
-        for (int i = 0; i < pal_ncolors; i++)
+        uint8_t *entries = malloc((size_t) SEARCH_GRID_CELLS * pal->ncolors);
+        uint32_t count = 0;
+        if (!entries) return false;
+
+        for (int cell = 0; cell < SEARCH_GRID_CELLS; cell++)
         {
-            pal[i].red = image->format->palette->colors[i].r;
-            pal[i].green = image->format->palette->colors[i].g;
-            pal[i].blue = image->format->palette->colors[i].b;
+            int redLow = (cell / (SEARCH_GRID_SIZE * SEARCH_GRID_SIZE)) * SEARCH_GRID_CELL_WIDTH;
+            int greenLow = (cell / SEARCH_GRID_SIZE % SEARCH_GRID_SIZE) * SEARCH_GRID_CELL_WIDTH;
+            int blueLow = (cell % SEARCH_GRID_SIZE) * SEARCH_GRID_CELL_WIDTH;
+            int nearSq[256], bound = INT32_MAX;
+
+            for (int j = skip; j < pal->ncolors; j++)
+            {
+                int farSq = 0;
+                nearSq[j] = 0;
+                cellChannelDistances(pal->colors[j].red, redLow, &nearSq[j], &farSq);
+                cellChannelDistances(pal->colors[j].green, greenLow, &nearSq[j], &farSq);
+                cellChannelDistances(pal->colors[j].blue, blueLow, &nearSq[j], &farSq);
+                if (farSq < bound) bound = farSq;
+            }
+
+            pal->gridStart[skip][cell] = count;
+            for (int j = skip; j < pal->ncolors; j++)
+            {
+                if (nearSq[j] <= bound) entries[count++] = j;
+            }
         }
-        printf("read palette with %i colors from %s\n", pal_ncolors, path);
-        SDL_FreeSurface(image);
-        return true;
+        pal->gridStart[skip][SEARCH_GRID_CELLS] = count;
+
+        // the lists are usually a small fraction of the worst case
+        uint8_t *shrunk = realloc(entries, count ? count : 1);
+        pal->gridEntries[skip] = shrunk ? shrunk : entries;
     }
+    return true;
 }
 
-bool readPalette(const char *path)
+// nearestColor() that only looks at the entries listed for the color's cell of the search grid. On photographic
+// sources, where the nearest-color cache misses a lot, this usually checks a handful of colors instead of the whole
+// palette. Palettes with many colors close together (a grayscale ramp, say) can leave long lists in some cells, and
+// those go to the vectorized search instead.
+static uint8_t nearestColorGrid(const Palette *pal, uint8_t r, uint8_t g, uint8_t b, bool skipTransparent)
 {
-    bool result;
+    int shift = 8 - SEARCH_GRID_BITS;
+    int cell = (((r >> shift) << SEARCH_GRID_BITS | (g >> shift)) << SEARCH_GRID_BITS) | (b >> shift);
+    const uint8_t *entries = pal->gridEntries[skipTransparent];
+    uint32_t start = pal->gridStart[skipTransparent][cell], end = pal->gridStart[skipTransparent][cell + 1];
+    int nearest = 1;
+    int nearestDist = INT32_MAX;
 
-    const char *extension = strrchr(path, '.');
-    if (extension != NULL && stricmp(extension, ".act") == 0)
+    if (end - start > pal->gridMaxList) return pal->scan(pal, r, g, b, skipTransparent);
+    for (uint32_t k = start; k < end; k++)
     {
-        result = readPaletteFromACT(path);
+        int j = entries[k];
+        int rdist = r - pal->colors[j].red;
+        int gdist = g - pal->colors[j].green;
+        int bdist = b - pal->colors[j].blue;
+        int dist = rdist * rdist + gdist * gdist + bdist * bdist;
+        if (dist < nearestDist)
+        {
+            nearestDist = dist;
+            nearest = j;
+        }
     }
-    else
+    return nearest;
+}
+
+// The perceptual metrics work in color spaces that are too expensive to convert to for every pixel, but source colors
+// only get converted on a nearest-color cache miss, and the palette is converted once when it's loaded. Linear light
+// comes from a 256-entry table in the palette.
+static void rgbToLab(const Palette *pal, uint8_t r, uint8_t g, uint8_t b, float lab[3])
+{
+    const float epsilon = 216.0f / 24389, kappa = 24389.0f / 27;
+    float lr = pal->linear[r], lg = pal->linear[g], lb = pal->linear[b];
+    float xyz[3] = {
+        (0.4124564f * lr + 0.3575761f * lg + 0.1804375f * lb) / 0.95047f,
+        0.2126729f * lr + 0.7151522f * lg + 0.0721750f * lb,
+        (0.0193339f * lr + 0.1191920f * lg + 0.9503041f * lb) / 1.08883f,
+    };
+    float f[3];
+
+    for (int i = 0; i < 3; i++)
     {
-        result = readPaletteFromImage(path);
+        f[i] = xyz[i] > epsilon ? cbrtf(xyz[i]) : (kappa * xyz[i] + 16) / 116;
     }
+    lab[0] = 116 * f[1] - 16;
+    lab[1] = 500 * (f[0] - f[1]);
+    lab[2] = 200 * (f[1] - f[2]);
+}
 
-    // ACT and GIF palettes are always power-of-two sizes, so they're padded out with unused blacks or whites.
-    // PNG has no such limitation, so we can reduce the size of our output images by removing the padding from the
-    // palette with a simple algorithm: while the last two colors in the palette are the same, reduce the size of the
-    // palette by 1. This removes all but 1 of the padding entries while ensuring that no colors are lost.
-    if (result == true)
+static void rgbToOklab(const Palette *pal, uint8_t r, uint8_t g, uint8_t b, float lab[3])
+{
+    float lr = pal->linear[r], lg = pal->linear[g], lb = pal->linear[b];
+    float l = cbrtf(0.4122214708f * lr + 0.5363325363f * lg + 0.0514459929f * lb);
+    float m = cbrtf(0.2119034982f * lr + 0.6806995451f * lg + 0.1073969566f * lb);
+    float s = cbrtf(0.0883024619f * lr + 0.2817188376f * lg + 0.6299787005f * lb);
+
+    lab[0] = 0.2104542553f * l + 0.7936177850f * m - 0.0040720468f * s;
+    lab[1] = 1.9779984951f * l - 2.4285922050f * m + 0.4505937099f * s;
+    lab[2] = 0.0259040371f * l + 0.7827717662f * m - 0.8086757660f * s;
+}
+
+// nearestColor() for colors that have already been converted to the same space as the palette colors in space
+static uint8_t nearestInSpace(const Palette *pal, const float (*space)[3], const float color[3], bool skipTransparent)
+{
+    int nearest = 1;
+    float nearestDist = INFINITY;
+
+    for (int j = skipTransparent ? 1 : 0; j < pal->ncolors; j++)
     {
-        while (pal_ncolors > 2 && 0 == memcmp(&pal[pal_ncolors - 2], &pal[pal_ncolors - 1], 3))
+        float d0 = color[0] - space[j][0], d1 = color[1] - space[j][1], d2 = color[2] - space[j][2];
+        float dist = d0 * d0 + d1 * d1 + d2 * d2;
+        if (dist < nearestDist)
         {
-            --pal_ncolors;
+            nearestDist = dist;
+            nearest = j;
         }
     }
+    return nearest;
+}
 
-    return result;
+static uint8_t nearestColorLab(const Palette *pal, uint8_t r, uint8_t g, uint8_t b, bool skipTransparent)
+{
+    float lab[3];
+    rgbToLab(pal, r, g, b, lab);
+    return nearestInSpace(pal, pal->lab, lab, skipTransparent);
 }
 
-SDL_Surface *readSourceImage(const char *path)
+static uint8_t nearestColorOklab(const Palette *pal, uint8_t r, uint8_t g, uint8_t b, bool skipTransparent)
 {
-    SDL_Surface *image = IMG_Load(path);
-    if (!image)
+    float lab[3];
+    rgbToOklab(pal, r, g, b, lab);
+    return nearestInSpace(pal, pal->oklab, lab, skipTransparent);
+}
+
+// The "redmean" approximation: green counts the most, and red counts for more than blue in reddish colors and less in
+// bluish ones. Scaled up so that everything stays in exact integers.
+static uint8_t nearestColorWeighted(const Palette *pal, uint8_t r, uint8_t g, uint8_t b, bool skipTransparent)
+{
+    int nearest = 1;
+    int nearestDist = INT32_MAX;
+
+    for (int j = skipTransparent ? 1 : 0; j < pal->ncolors; j++)
     {
-        printf("Error: %s\n", SDL_GetError());
-        return NULL;
+        int redSum = r + pal->colors[j].red;
+        int rdist = r - pal->colors[j].red;
+        int gdist = g - pal->colors[j].green;
+        int bdist = b - pal->colors[j].blue;
+        int dist = (1024 + redSum) * rdist * rdist + 2048 * gdist * gdist + (1534 - redSum) * bdist * bdist;
+        if (dist < nearestDist)
+        {
+            nearestDist = dist;
+            nearest = j;
+        }
     }
+    return nearest;
+}
 
-    if (image->format->Amask)
+static NearestColorFunc metricSearch(const Palette *pal, ColorMetric metric)
+{
+    switch (metric)
     {
-        printf("has alpha channel\n");
+        case COLOR_METRIC_WEIGHTED_RGB: return nearestColorWeighted;
+        case COLOR_METRIC_CIELAB: return nearestColorLab;
+        case COLOR_METRIC_OKLAB: return nearestColorOklab;
+        default: return pal->search;
     }
-    else
+}
+
+static void preparePerceptualSpaces(Palette *pal)
+{
+    for (int i = 0; i < 256; i++)
     {
-        printf("no alpha channel\n");
+        float c = i / 255.0f;
+        pal->linear[i] = c <= 0.04045f ? c / 12.92f : powf((c + 0.055f) / 1.055f, 2.4f);
+    }
+    for (int i = 0; i < pal->ncolors; i++)
+    {
+        rgbToLab(pal, pal->colors[i].red, pal->colors[i].green, pal->colors[i].blue, pal->lab[i]);
+        rgbToOklab(pal, pal->colors[i].red, pal->colors[i].green, pal->colors[i].blue, pal->oklab[i]);
     }
+}
 
-    SDL_Surface *image32 = SDL_CreateRGBSurface(0, image->w, image->h, 32,
-            0xFF, 0xFF00, 0xFF0000, image->format->Amask ? 0xFF000000 : 0);
-    SDL_SetSurfaceBlendMode(image, SDL_BLENDMODE_NONE);
-    SDL_BlitSurface(image, NULL, image32, NULL);
-    SDL_FreeSurface(image);
+// Fills in the per-channel arrays used by the vectorized search, picks the fastest search the CPU supports, and builds
+// the search grid on top of it.
+static void preparePaletteSearch(Palette *pal)
+{
+    pal->laneCount = (pal->ncolors + 15) & ~15;
+    for (int i = 0; i < 256; i++)
+    {
+        bool used = i < pal->ncolors;
+        pal->laneRed[0][i] = used ? pal->colors[i].red : EXCLUDED_LANE_VALUE;
+        pal->laneRed[1][i] = (used && i != 0) ? pal->colors[i].red : EXCLUDED_LANE_VALUE;
+        pal->laneGreen[i] = used ? pal->colors[i].green : 0;
+        pal->laneBlue[i] = used ? pal->colors[i].blue : 0;
+    }
 
-    // If there's technically an "alpha channel" but every pixel is 100% opaque, there isn't really an alpha channel.
-    if (image32->format->Amask && alphaType(image32) == ALPHA_NONE)
+    // A grid cell's list is checked one entry at a time, so past a certain length the vectorized scan of the whole
+    // palette is faster; these limits are about where that happens.
+    pal->scan = nearestColor;
+    pal->gridMaxList = 256;
+#ifdef HAVE_SIMD_SEARCH
+    if (SDL_HasAVX2())
+    {
+        pal->scan = nearestColorAVX2;
+        pal->gridMaxList = pal->laneCount / 8 + 8;
+    }
+    else if (SDL_HasSSE2())
     {
-        image32->format->Amask = 0;
+        pal->scan = nearestColorSSE2;
+        pal->gridMaxList = pal->laneCount / 4 + 8;
     }
+#endif
+    pal->search = prepareSearchGrid(pal) ? nearestColorGrid : pal->scan;
+    preparePerceptualSpaces(pal);
+}
 
-    return image32;
+// Allocates an empty nearest-color cache for one conversion with the given metric. Returns NULL if out of memory.
+static NearestColorCache *newNearestColorCache(const Palette *pal, ColorMetric metric)
+{
+    NearestColorCache *cache = calloc(1, sizeof(NearestColorCache));
+    if (cache) cache->search = metricSearch(pal, metric);
+    return cache;
 }
 
-// saves image as indexed PNG using nearest-color algorithm
-bool saveIndexedPNG(const char *path, SDL_Surface *screen)
+// forgets every cached result, for when the value of skipTransparent the cache is used with has to change
+static void clearNearestColorCache(NearestColorCache *cache)
 {
-    uint32_t *source;
-    int i, x, y;
-    png_structp png_ptr;
-    png_infop info_ptr;
-    FILE *fp;
-    uint8_t *line;
+    memset(cache->keys, 0, sizeof(cache->keys));
+}
 
-    fp = fopen(path, "wb");
-    if (!fp) return false;
-    png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-    if (!png_ptr) return false;
-    info_ptr = png_create_info_struct(png_ptr);
-    if (!info_ptr)
+// Same as nearestColor(), but checks the cache first. A cache must only ever be used with one palette and one value of
+// skipTransparent. The cache is per conversion, since the palette itself is shared between threads.
+static uint8_t nearestColorCached(const Palette *pal, NearestColorCache *cache, uint32_t color, bool skipTransparent)
+{
+    uint32_t rgb = color & 0xffffff;
+    uint32_t slot = (rgb * 2654435761u) >> (32 - NEAREST_CACHE_BITS);
+    uint32_t key = rgb | 0x80000000;
+
+    cache->lookups++;
+    if (cache->keys[slot] != key)
     {
-        png_destroy_write_struct(&png_ptr, (png_infopp)NULL);
-        fclose(fp);
-        return false;
+        cache->searches++;
+        cache->keys[slot] = key;
+        cache->values[slot] = cache->search(pal, rgb & 0xff, (rgb >> 8) & 0xff, (rgb >> 16) & 0xff, skipTransparent);
     }
+    return cache->values[slot];
+}
 
-    png_init_io(png_ptr, fp);
-    png_set_compression_level(png_ptr, Z_BEST_COMPRESSION);
-    png_set_IHDR(png_ptr, info_ptr, screen->w, screen->h,
-                 8, PNG_COLOR_TYPE_PALETTE, PNG_INTERLACE_NONE,
-                 PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
-    png_set_PLTE(png_ptr, info_ptr, pal, pal_ncolors);
-    png_write_info(png_ptr, info_ptr);
-    line = (uint8_t*) malloc(screen->w);
+// Maps a row of 32-bit RGBA pixels to palette indices. If hasAlpha is set, fully transparent pixels map to the
+// transparent color (0) and no other pixel does. If alphaDest isn't NULL, the alpha values are copied out to it in the
+// same pass.
+static void quantizeRow(const Palette *pal, NearestColorCache *cache, const uint32_t *source, uint8_t *dest, int width,
+                        bool hasAlpha, uint8_t *alphaDest)
+{
+    for (int x = 0; x < width; x++)
+    {
+        uint32_t color = source[x];
+        uint8_t a = (color >> 24) & 0xff;
 
-    source = screen->pixels;
+        if (alphaDest) alphaDest[x] = a;
+        if (hasAlpha && a == 0) dest[x] = 0;
+        else dest[x] = nearestColorCached(pal, cache, color, hasAlpha);
+    }
+}
 
-    for (y = 0; y < screen->h; y++)
-    {
-        source = (uint32_t *)(screen->pixels + (y * screen->pitch));
-        for (i = 0, x = 0; x < screen->w; x++)
-        {
-            uint32_t color = 0;
-            uint8_t r = 0, g = 0, b = 0, a = 0, nearest = 1;
+// Error diffusion reaches at most DITHER_PAD pixels to either side and DITHER_ROWS - 1 rows down.
+#define DITHER_PAD 2
+#define DITHER_ROWS 3
 
-            color = source[x];
-            r = color & 0xff;
-            g = (color >> 8) & 0xff;
-            b = (color >> 16) & 0xff;
-            a = (color >> 24) & 0xff;
+// Dithering state for one conversion. Error diffusion has to see the rows in order, and keeps the errors passed on
+// to the rows below in a few row-sized buffers that are recycled as it goes, so no full-size buffer is ever needed.
+// Ordered dithering has no state beyond the mode, so it can be used on any number of rows at once.
+typedef struct {
+    DitherMode mode;
+    int spread;              // for ordered dithering, how far the threshold pattern moves colors either way
+    int width;
+    int *errors[DITHER_ROWS]; // for error diffusion, 3 channels per pixel with DITHER_PAD pixels of padding each side
+} Ditherer;
 
-            if (screen->format->Amask && a == 0) nearest = 0;
-            else
-            {
-                int j;
-                int nearest_dist_sq = 9999999;
-                /* If the source has an alpha mask, don't use the transparent color (0) for any
-                 * pixels that aren't completely transparent. */
-                for (j = screen->format->Amask ? 1 : 0; j < pal_ncolors; j++)
-                {
-                    int rdist = r - pal[j].red;
-                    int gdist = g - pal[j].green;
-                    int bdist = b - pal[j].blue;
-                    int dist_sq = rdist*rdist + gdist*gdist + bdist*bdist;
-                    if (dist_sq < nearest_dist_sq)
-                    {
-                        nearest_dist_sq = dist_sq;
-                        nearest = j;
-                    }
-                }
-            }
+static const uint8_t bayer8[8][8] = {
+    {  0, 32,  8, 40,  2, 34, 10, 42 },
+    { 48, 16, 56, 24, 50, 18, 58, 26 },
+    { 12, 44,  4, 36, 14, 46,  6, 38 },
+    { 60, 28, 52, 20, 62, 30, 54, 22 },
+    {  3, 35, 11, 43,  1, 33,  9, 41 },
+    { 51, 19, 59, 27, 49, 17, 57, 25 },
+    { 15, 47,  7, 39, 13, 45,  5, 37 },
+    { 63, 31, 55, 23, 61, 29, 53, 21 },
+};
 
-            line[i++] = nearest;
-        }
-        png_write_row(png_ptr, line);
-    }
-    free(line);
-    line = NULL;
-    png_write_end(png_ptr, info_ptr);
-    png_destroy_write_struct(&png_ptr, &info_ptr);
-    fclose(fp);
-    return true;
+static bool isErrorDiffusion(DitherMode mode)
+{
+    return mode == DITHER_FLOYD_STEINBERG || mode == DITHER_ATKINSON;
 }
 
-// saves alpha mask of image
-bool saveMask(const char* filename, SDL_Surface *screen)
+static void ditherFree(Ditherer *dither)
 {
-    uint32_t *source;
-    int i, x, y;
-    png_structp png_ptr;
-    png_infop info_ptr;
-    FILE *fp;
-    uint8_t *line;
-
-    fp = fopen(filename, "wb");
-    if (!fp) return false;
-    png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-    if (!png_ptr) return false;
-    info_ptr = png_create_info_struct(png_ptr);
-    if (!info_ptr)
+    for (int i = 0; i < DITHER_ROWS; i++)
     {
-        png_destroy_write_struct(&png_ptr, (png_infopp)NULL);
-        fclose(fp);
-        return false;
+        free(dither->errors[i]);
+        dither->errors[i] = NULL;
     }
-    png_init_io(png_ptr, fp);
-    png_set_compression_level(png_ptr, Z_BEST_COMPRESSION);
-    png_set_IHDR(png_ptr, info_ptr, screen->w, screen->h,
-                 8, PNG_COLOR_TYPE_GRAY, PNG_INTERLACE_NONE,
-                 PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
-    png_write_info(png_ptr, info_ptr);
-    line = (uint8_t*) malloc(screen->w);
+}
+
+static bool ditherInit(Ditherer *dither, const Palette *pal, DitherMode mode, int width)
+{
+    memset(dither, 0, sizeof(*dither));
+    dither->mode = mode;
+    dither->width = width;
 
+    // roughly the spacing of the palette colors if they were spread evenly through the RGB cube
+    dither->spread = (int)(256 / cbrtf(pal->ncolors));
 
-    for (y = 0; y < screen->h; y++)
+    if (isErrorDiffusion(mode))
     {
-        source = (uint32_t *)(screen->pixels + (y * screen->pitch));
-        for (i = 0, x = 0; x < screen->w; x++)
+        for (int i = 0; i < DITHER_ROWS; i++)
         {
-            uint32_t color = source[x];
-            uint8_t a = (color >> 24) & 0xff;
-            line[i++] = a;
+            dither->errors[i] = calloc((size_t)(width + 2 * DITHER_PAD) * 3, sizeof(int));
+            if (!dither->errors[i])
+            {
+                ditherFree(dither);
+                return false;
+            }
         }
-        png_write_row(png_ptr, line);
     }
-    free(line);
-    line = NULL;
-    png_write_end(png_ptr, info_ptr);
-    png_destroy_write_struct(&png_ptr, &info_ptr);
-    fclose(fp);
     return true;
 }
 
-// returns true if and only if alpha channel of img has at least one alpha value that isn't 0 or 255
-AlphaType alphaType(SDL_Surface *img)
+static uint8_t clampChannel(int value)
 {
-    uint32_t x, y, *color;
-    AlphaType alphaType = ALPHA_NONE;
+    return value < 0 ? 0 : (value > 255 ? 255 : value);
+}
+
+// adds weight times the error of a pixel to one of the pixels it is passed on to
+static void spreadError(int *errors, int x, const int error[3], int weight)
+{
+    int *target = errors + (x + DITHER_PAD) * 3;
+    target[0] += error[0] * weight;
+    target[1] += error[1] * weight;
+    target[2] += error[2] * weight;
+}
+
+// quantizeRow() with dithering. y is the row's position in the image; with error diffusion, every row of the image
+// has to go through here exactly once, from top to bottom. Transparent pixels neither take nor pass on any error.
+static void quantizeDitheredRow(const Palette *pal, NearestColorCache *cache, Ditherer *dither, const uint32_t *source,
+                                uint8_t *dest, int width, int y, bool hasAlpha, uint8_t *alphaDest)
+{
+    bool diffuse = isErrorDiffusion(dither->mode);
+    int divisor = (dither->mode == DITHER_ATKINSON) ? 8 : 16; // the errors are kept multiplied by this
+    int *current = dither->errors[0];
 
-    for (y = 0; y < img->h; y++)
+    for (int x = 0; x < width; x++)
     {
-        color = img->pixels + (y * img->pitch);
-        for (x = 0; x < img->w; x++)
+        uint32_t color = source[x];
+        uint8_t a = (color >> 24) & 0xff;
+        int r = color & 0xff, g = (color >> 8) & 0xff, b = (color >> 16) & 0xff;
+
+        if (alphaDest) alphaDest[x] = a;
+        if (hasAlpha && a == 0)
+        {
+            dest[x] = 0;
+            continue;
+        }
+
+        if (diffuse)
+        {
+            const int *carried = current + (x + DITHER_PAD) * 3;
+            r += carried[0] / divisor;
+            g += carried[1] / divisor;
+            b += carried[2] / divisor;
+        }
+        else
+        {
+            int offset = (2 * bayer8[y & 7][x & 7] + 1 - 64) * dither->spread / 128;
+            r += offset;
+            g += offset;
+            b += offset;
+        }
+
+        r = clampChannel(r);
+        g = clampChannel(g);
+        b = clampChannel(b);
+        uint8_t index = nearestColorCached(pal, cache, r | (g << 8) | (b << 16), hasAlpha);
+        dest[x] = index;
+
+        if (diffuse)
         {
-            uint32_t alpha = ((*color) >> 24) & 0xff;
-            if (alpha == 0)
+            int error[3] = { r - pal->colors[index].red, g - pal->colors[index].green, b - pal->colors[index].blue };
+            if (dither->mode == DITHER_FLOYD_STEINBERG)
             {
-                alphaType = ALPHA_SIMPLE;
+                spreadError(current, x + 1, error, 7);
+                spreadError(dither->errors[1], x - 1, error, 3);
+                spreadError(dither->errors[1], x, error, 5);
+                spreadError(dither->errors[1], x + 1, error, 1);
             }
-            else if (alpha != 255)
+            else
             {
-                return ALPHA_MASK_NEEDED;
+                spreadError(current, x + 1, error, 1);
+                spreadError(current, x + 2, error, 1);
+                spreadError(dither->errors[1], x - 1, error, 1);
+                spreadError(dither->errors[1], x, error, 1);
+                spreadError(dither->errors[1], x + 1, error, 1);
+                spreadError(dither->errors[2], x, error, 1);
             }
-            color++;
         }
     }
 
-    return alphaType;
+    if (diffuse)
+    {
+        // this row's buffer is done with, and is cleared to become the one furthest down
+        for (int i = 0; i < DITHER_ROWS - 1; i++)
+        {
+            dither->errors[i] = dither->errors[i + 1];
+        }
+        memset(current, 0, (size_t)(dither->width + 2 * DITHER_PAD) * 3 * sizeof(int));
+        dither->errors[DITHER_ROWS - 1] = current;
+    }
 }
 
-int commandLineMain(int argc, char **argv)
+// Quantizes row y with whatever dithering the conversion uses.
+static void quantizeImageRow(const Palette *pal, NearestColorCache *cache, Ditherer *dither, const uint32_t *source,
+                             uint8_t *dest, int width, int y, bool hasAlpha, uint8_t *alphaDest)
 {
-    if (argc != 4 && argc != 5) // alpha masking is optional
+    if (dither->mode == DITHER_NONE) quantizeRow(pal, cache, source, dest, width, hasAlpha, alphaDest);
+    else quantizeDitheredRow(pal, cache, dither, source, dest, width, y, hasAlpha, alphaDest);
+}
+
+
+static bool readPaletteFromACT(const char *path, Palette *pal)
+{
+    FILE *fp = fopen(path, "rb");
+
+    if (fp == NULL)
     {
-        fprintf(stderr, "Usage: %s palette source result [result_mask]\n", argv[0]);
-        fprintf(stderr, "\n");
-        fprintf(stderr, "palette: an indexed PNG with the target palette\n");
-        fprintf(stderr, "source: the PNG to apply the palette to and generate the mask from;\n"
-                        "        can be RGB, indexed, or grayscale, with or without alpha\n");
-        fprintf(stderr, "result: path to which to save the resulting image as an indexed PNG\n");
-        fprintf(stderr, "result_mask: path to which to save the resulting alpha mask as a grayscale PNG\n");
-        fprintf(stderr, "\n");
-        fprintf(stderr, "The result_mask parameter can be omitted to skip producing an alpha mask.\n");
-        fprintf(stderr, "Note that result and result_mask will be overwritten if the paths already exist.\n");
-        return 1;
+        return false;
     }
 
-    if (!readPalette(argv[1]))
+    for (int i = 0; i < 256; i++)
     {
-        fprintf(stderr, "error: failed to load palette image '%s'\n", argv[1]);
-        goto error;
+        if (fread(&pal->colors[i].red, 1, 1, fp) != 1 ||
+            fread(&pal->colors[i].green, 1, 1, fp) != 1 ||
+            fread(&pal->colors[i].blue, 1, 1, fp) != 1)
+        {
+            fclose(fp);
+            return false;
+        }
     }
 
-    SDL_Surface *img = readSourceImage(argv[2]);
-    if (img)
+    pal->ncolors = 256;
+    fclose(fp);
+    return true;
+}
+
+static bool readPaletteFromImage(const char *path, Palette *pal)
+{
+    SDL_Surface *image = IMG_Load(path);
+    if (!image)
+    {
+        printf("Error: %s\n", SDL_GetError());
+        return false;
+    }
+    else if (!image->format->palette)
     {
-        printf("read image %s\n", argv[2]);
+        printf("Error: palette image %s is not indexed\n", path);
+        SDL_FreeSurface(image);
+        return false;
     }
     else
     {
-        fprintf(stderr, "error: failed to load image %s\n", argv[2]);
-        goto error;
+        pal->ncolors = image->format->palette->ncolors;
+        for (int i = 0; i < pal->ncolors; i++)
+        {
+            pal->colors[i].red = image->format->palette->colors[i].r;
+            pal->colors[i].green = image->format->palette->colors[i].g;
+            pal->colors[i].blue = image->format->palette->colors[i].b;
+        }
+        printf("read palette with %i colors from %s\n", pal->ncolors, path);
+        SDL_FreeSurface(image);
+        return true;
     }
+}
+
+// Loads a palette and prepares it for use. Returns NULL on failure. The result should be freed with freePalette().
+Palette *readPalette(const char *path)
+{
+    bool result;
+    Palette *pal = calloc(1, sizeof(Palette));
+    if (!pal) return NULL;
 
-    if (!saveIndexedPNG(argv[3], img))
+    const char *extension = strrchr(path, '.');
+    if (extension != NULL && stricmp(extension, ".act") == 0)
+    {
+        result = readPaletteFromACT(path, pal);
+    }
+    else
     {
-        fprintf(stderr, "error: failed to save result '%s'\n", argv[3]);
-        goto error;
-    } else printf("saved result to '%s'\n", argv[3]);
+        result = readPaletteFromImage(path, pal);
+    }
 
-    if (img->format->Amask)
+    // ACT and GIF palettes are always power-of-two sizes, so they're padded out with unused blacks or whites.
+    // PNG has no such limitation, so we can reduce the size of our output images by removing the padding from the
+    // palette with a simple algorithm: while the last two colors in the palette are the same, reduce the size of the
+    // palette by 1. This removes all but 1 of the padding entries while ensuring that no colors are lost.
+    if (result == true)
     {
-        if (alphaType(img) == ALPHA_MASK_NEEDED)
+        while (pal->ncolors > 2 && 0 == memcmp(&pal->colors[pal->ncolors - 2], &pal->colors[pal->ncolors - 1], 3))
         {
-            if (argc < 5)
-            {
-                fprintf(stderr, "warning: source has non-trivial alpha, but no mask filename given");
-            }
-            else if (!saveMask(argv[4], img))
-            {
-                fprintf(stderr, "error: failed to save alpha mask '%s'\n", argv[4]);
-                goto error;
-            }
-            else printf("saved alpha mask to '%s'\n", argv[4]);
+            --pal->ncolors;
         }
-        else printf("no alpha mask needed (simple alpha channel)\n");
-    } else printf("no alpha mask needed (source has no alpha channel)\n");
+        preparePaletteSearch(pal);
+    }
+    else
+    {
+        free(pal);
+        pal = NULL;
+    }
 
-    SDL_FreeSurface(img);
+    return pal;
+}
 
+void freePalette(Palette *pal)
+{
+    if (!pal) return;
+    free(pal->gridEntries[0]);
+    free(pal->gridEntries[1]);
+    free(pal);
+}
+
+// copies the palette's colors into the given array and returns how many there are
+int paletteColors(const Palette *pal, SDL_Color colors[256])
+{
+    for (int i = 0; i < pal->ncolors; i++)
+    {
+        colors[i] = (SDL_Color) { pal->colors[i].red, pal->colors[i].green, pal->colors[i].blue, 255 };
+    }
+    return pal->ncolors;
+}
+
+// reads a single pixel value in the surface's own format, for comparing against the color key
+static uint32_t rawPixel(const uint8_t *pixel, int bytesPerPixel)
+{
+    switch (bytesPerPixel)
+    {
+        case 1: return pixel[0];
+        case 2: return *(const uint16_t*) pixel;
+#if SDL_BYTEORDER == SDL_LIL_ENDIAN
+        case 3: return pixel[0] | (pixel[1] << 8) | (pixel[2] << 16);
+#else
+        case 3: return (pixel[0] << 16) | (pixel[1] << 8) | pixel[2];
+#endif
+        default: return *(const uint32_t*) pixel;
+    }
+}
+
+// Returns row y of the surface as 32-bit RGBA with red in the low byte, which is the layout everything after decoding
+// works on. Rows that are already in that layout are returned in place; anything else is converted into rowBuffer,
+// which must have room for one row. Pixels matching the color key come out as 0, just as if the image had been
+// blitted onto a blank RGBA surface.
+static const uint32_t *readSourceRow(SDL_Surface *surface, int y, uint32_t *rowBuffer)
+{
+    const SDL_PixelFormat *format = surface->format;
+    const uint8_t *source = (const uint8_t*) surface->pixels + y * surface->pitch;
+    uint32_t key;
+    bool hasKey = SDL_GetColorKey(surface, &key) == 0;
+    int x;
+
+    if (format->format == SDL_PIXELFORMAT_ABGR8888 && !hasKey)
+    {
+        return (const uint32_t*) source;
+    }
+
+    if (format->palette)
+    {
+        const SDL_Color *colors = format->palette->colors;
+        for (x = 0; x < surface->w; x++)
+        {
+            SDL_Color color = colors[source[x]];
+            rowBuffer[x] = color.r | (color.g << 8) | (color.b << 16) | ((uint32_t) color.a << 24);
+        }
+    }
+    else
+    {
+        SDL_ConvertPixels(surface->w, 1, format->format, source, surface->pitch,
+                          SDL_PIXELFORMAT_ABGR8888, rowBuffer, surface->w * 4);
+    }
+
+    if (hasKey)
+    {
+        for (x = 0; x < surface->w; x++)
+        {
+            if (rawPixel(source + x * format->BytesPerPixel, format->BytesPerPixel) == key) rowBuffer[x] = 0;
+        }
+    }
+    return rowBuffer;
+}
+
+// readSourceImage() with the time it takes added to stats, if that isn't NULL
+static bool readSourceImageTimed(const char *path, SourceImage *result, ConversionStats *stats)
+{
+    Uint64 mark = stageMark(stats);
+    SDL_Surface *image = IMG_Load(path);
+    stageLap(stats, STAGE_DECODE, &mark);
+    if (!image)
+    {
+        printf("Error: %s\n", SDL_GetError());
+        return false;
+    }
+
+    if (image->format->Amask)
+    {
+        printf("has alpha channel\n");
+    }
+    else
+    {
+        printf("no alpha channel\n");
+    }
+
+    // Indexed formats with less than a byte per pixel are rare enough (some BMPs and PCXs) that they just get
+    // converted up front instead of having their own row reader.
+    if (image->format->palette && image->format->BitsPerPixel < 8)
+    {
+        SDL_Surface *image32 = SDL_CreateRGBSurface(0, image->w, image->h, 32, 0xFF, 0xFF00, 0xFF0000, 0);
+        if (!image32)
+        {
+            SDL_FreeSurface(image);
+            return false;
+        }
+        SDL_SetSurfaceBlendMode(image, SDL_BLENDMODE_NONE);
+        SDL_BlitSurface(image, NULL, image32, NULL);
+        SDL_FreeSurface(image);
+        image = image32;
+    }
+
+    // If there's technically an "alpha channel" but every pixel is 100% opaque, there isn't really an alpha channel.
+    result->alphaType = alphaType(image);
+    result->surface = image;
+    stageLap(stats, STAGE_CONVERT, &mark);
+    return true;
+}
+
+// Reads an image and classifies its alpha channel. The image is kept in whatever format it was decoded to, and each
+// row is converted to RGBA as it's needed, so there is never a second full-size copy of it in memory.
+bool readSourceImage(const char *path, SourceImage *result)
+{
+    return readSourceImageTimed(path, result, NULL);
+}
+
+static uint32_t readLE16(const uint8_t *p) { return p[0] | (p[1] << 8); }
+static uint32_t readLE32(const uint8_t *p) { return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24); }
+static uint32_t readBE32(const uint8_t *p) { return ((uint32_t) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3]; }
+
+// Reads the dimensions of a PNG, GIF, BMP or PCX image from its header, without decoding any pixels. Returns false if
+// the file can't be read or isn't in one of those formats.
+bool readImageSize(const char *path, int *width, int *height)
+{
+    uint8_t header[26];
+    int64_t w, h;
+    FILE *fp = fopen(path, "rb");
+    if (!fp) return false;
+    size_t length = fread(header, 1, sizeof(header), fp);
+    fclose(fp);
+
+    if (length >= 24 && memcmp(header, "\x89PNG\r\n\x1a\n", 8) == 0)
+    {
+        w = readBE32(header + 16);
+        h = readBE32(header + 20);
+    }
+    else if (length >= 10 && memcmp(header, "GIF", 3) == 0)
+    {
+        w = readLE16(header + 6);
+        h = readLE16(header + 8);
+    }
+    else if (length >= 26 && header[0] == 'B' && header[1] == 'M')
+    {
+        // OS/2 1.x bitmaps have 16-bit dimensions, everything newer has 32-bit ones (negative heights are top-down)
+        bool os2 = readLE32(header + 14) == 12;
+        w = os2 ? (int64_t) readLE16(header + 18) : (int32_t) readLE32(header + 18);
+        h = os2 ? (int64_t) readLE16(header + 20) : (int32_t) readLE32(header + 22);
+        if (h < 0) h = -h;
+    }
+    else if (length >= 12 && header[0] == 0x0a && header[2] == 1)
+    {
+        w = (int64_t) readLE16(header + 8) - readLE16(header + 4) + 1;
+        h = (int64_t) readLE16(header + 10) - readLE16(header + 6) + 1;
+    }
+    else
+    {
+        return false;
+    }
+
+    if (w <= 0 || h <= 0 || w > INT32_MAX || h > INT32_MAX) return false;
+    *width = (int) w;
+    *height = (int) h;
+    return true;
+}
+
+void freeSourceImage(SourceImage *image)
+{
+    SDL_FreeSurface(image->surface);
+    image->surface = NULL;
+}
+
+// true if transparent pixels of the image should map to the transparent color (0)
+static bool sourceHasAlpha(const SourceImage *image)
+{
+    return image->alphaType != ALPHA_NONE;
+}
+
+// true once the conversion has been told to stop through ConvertOptions.cancel
+static bool conversionCanceled(SDL_atomic_t *cancel)
+{
+    return cancel != NULL && SDL_AtomicGet(cancel) != 0;
+}
+
+// Takes up to wanted CPUs from a conversion's share of spare CPUs for its helper threads (see
+// ConvertOptions.spareThreads), and returns how many it got. With no shared count, every CPU but this one is fair game.
+static int takeHelperThreads(SDL_atomic_t *spareThreads, int wanted)
+{
+    int available, taken;
+
+    if (wanted > SDL_GetCPUCount() - 1) wanted = SDL_GetCPUCount() - 1;
+    if (!spareThreads) return wanted > 0 ? wanted : 0;
+    do
+    {
+        available = SDL_AtomicGet(spareThreads);
+        taken = wanted < available ? wanted : available;
+        if (taken <= 0) return 0;
+    } while (!SDL_AtomicCAS(spareThreads, available, available - taken));
+    return taken;
+}
+
+// gives back CPUs taken with takeHelperThreads() once their helpers are done
+static void returnHelperThreads(SDL_atomic_t *spareThreads, int count)
+{
+    if (spareThreads && count > 0) SDL_AtomicAdd(spareThreads, count);
+}
+
+// zlib and PNG filter settings for each CompressionProfile. Indexed images almost never get smaller from filtering,
+// so they are always written unfiltered (which is also what libpng picks for them by default); the masks are smooth
+// grayscale and do benefit from it, except in the fast profile where skipping filter selection saves the most time.
+typedef struct {
+    int level;
+    int strategy; // used for unfiltered images; filtered images use Z_FILTERED
+    int windowBits;
+    int memLevel;
+    int maskFilters;
+} CompressionSettings;
+
+static const CompressionSettings compressionSettings[] = {
+    [COMPRESSION_FAST]     = { 1, Z_DEFAULT_STRATEGY, 15, 8, PNG_FILTER_NONE },
+    [COMPRESSION_BALANCED] = { 6, Z_DEFAULT_STRATEGY, 15, 8, PNG_FILTER_NONE | PNG_FILTER_SUB | PNG_FILTER_UP },
+    [COMPRESSION_SMALLEST] = { Z_BEST_COMPRESSION, Z_DEFAULT_STRATEGY, 15, 9, PNG_ALL_FILTERS },
+};
+
+static const char *const compressionProfileNames[] = {
+    [COMPRESSION_FAST]     = "fast",
+    [COMPRESSION_BALANCED] = "balanced",
+    [COMPRESSION_SMALLEST] = "smallest",
+};
+
+// looks up a profile by the name used on the command line and in the GUI; returns false if there is no such profile
+bool compressionProfileFromName(const char *name, CompressionProfile *profile)
+{
+    for (int i = 0; i < (int)(sizeof(compressionProfileNames) / sizeof(compressionProfileNames[0])); i++)
+    {
+        if (stricmp(name, compressionProfileNames[i]) == 0)
+        {
+            *profile = (CompressionProfile) i;
+            return true;
+        }
+    }
+    return false;
+}
+
+static const char *const colorMetricNames[] = {
+    [COLOR_METRIC_RGB]          = "rgb",
+    [COLOR_METRIC_WEIGHTED_RGB] = "weighted",
+    [COLOR_METRIC_CIELAB]       = "lab",
+    [COLOR_METRIC_OKLAB]        = "oklab",
+};
+
+// looks up a metric by the name used on the command line and in the GUI; returns false if there is no such metric
+bool colorMetricFromName(const char *name, ColorMetric *metric)
+{
+    for (int i = 0; i < (int)(sizeof(colorMetricNames) / sizeof(colorMetricNames[0])); i++)
+    {
+        if (stricmp(name, colorMetricNames[i]) == 0)
+        {
+            *metric = (ColorMetric) i;
+            return true;
+        }
+    }
+    return false;
+}
+
+static const char *const ditherModeNames[] = {
+    [DITHER_NONE]            = "none",
+    [DITHER_ORDERED]         = "ordered",
+    [DITHER_FLOYD_STEINBERG] = "floyd-steinberg",
+    [DITHER_ATKINSON]        = "atkinson",
+};
+
+// looks up a dithering mode by the name used on the command line and in the GUI; returns false if there is no such mode
+bool ditherModeFromName(const char *name, DitherMode *mode)
+{
+    for (int i = 0; i < (int)(sizeof(ditherModeNames) / sizeof(ditherModeNames[0])); i++)
+    {
+        if (stricmp(name, ditherModeNames[i]) == 0)
+        {
+            *mode = (DitherMode) i;
+            return true;
+        }
+    }
+    return false;
+}
+
+// The zlib and filter settings for encoding one PNG.
+typedef struct {
+    int level;
+    int strategy;
+    int windowBits;
+    int memLevel;
+    int filters;
+} EncodeSettings;
+
+static void profileEncodeSettings(CompressionProfile profile, int colorType, EncodeSettings *settings)
+{
+    const CompressionSettings *profileSettings = &compressionSettings[profile];
+    settings->level = profileSettings->level;
+    settings->windowBits = profileSettings->windowBits;
+    settings->memLevel = profileSettings->memLevel;
+    settings->filters = (colorType == PNG_COLOR_TYPE_PALETTE) ? PNG_FILTER_NONE : profileSettings->maskFilters;
+    settings->strategy = (settings->filters == PNG_FILTER_NONE) ? profileSettings->strategy : Z_FILTERED;
+}
+
+// Growable in-memory destination for PNGs that may or may not end up being saved.
+typedef struct {
+    uint8_t *data;
+    size_t size;
+    size_t capacity;
+    bool failed; // ran out of memory; the contents are incomplete
+} PngBuffer;
+
+static void pngBufferWrite(png_structp png_ptr, png_bytep data, png_size_t length)
+{
+    PngBuffer *buffer = (PngBuffer*) png_get_io_ptr(png_ptr);
+    if (buffer->failed) return;
+
+    if (buffer->size + length > buffer->capacity)
+    {
+        size_t capacity = buffer->capacity ? buffer->capacity * 2 : 65536;
+        while (capacity < buffer->size + length) capacity *= 2;
+        uint8_t *data = realloc(buffer->data, capacity);
+        if (!data)
+        {
+            buffer->failed = true;
+            return;
+        }
+        buffer->data = data;
+        buffer->capacity = capacity;
+    }
+    memcpy(buffer->data + buffer->size, data, length);
+    buffer->size += length;
+}
+
+static void pngBufferFlush(png_structp png_ptr)
+{
+    (void) png_ptr;
+}
+
+// An open indexed or grayscale PNG that is written one row at a time, either to a file or to a PngBuffer.
+typedef struct {
+    FILE *fp; // NULL when writing to memory
+    png_structp png_ptr;
+    png_infop info_ptr;
+    bool failed; // a write error happened; the rest of the rows are dropped and the file can't be finished
+} PngWriter;
+
+// Creates the file (or, if path is NULL, starts writing to buffer) and writes the PNG header. The colors are only
+// used (and required) for PNG_COLOR_TYPE_PALETTE.
+static bool pngWriterOpen(PngWriter *writer, const char *path, PngBuffer *buffer, int width, int height,
+                          int colorType, const png_color *colors, int ncolors, const EncodeSettings *settings)
+{
+    int bitDepth = 8;
+
+    // small palettes get packed into fewer bits per pixel; rows are still passed in with one byte per pixel
+    if (colorType == PNG_COLOR_TYPE_PALETTE)
+    {
+        if (ncolors <= 2) bitDepth = 1;
+        else if (ncolors <= 4) bitDepth = 2;
+        else if (ncolors <= 16) bitDepth = 4;
+    }
+
+    writer->png_ptr = NULL;
+    writer->info_ptr = NULL;
+    writer->fp = NULL;
+    writer->failed = false;
+    if (path)
+    {
+        writer->fp = fopen(path, "wb");
+        if (!writer->fp) return false;
+    }
+    writer->png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    if (!writer->png_ptr)
+    {
+        if (writer->fp) fclose(writer->fp);
+        writer->fp = NULL;
+        return false;
+    }
+    writer->info_ptr = png_create_info_struct(writer->png_ptr);
+    if (!writer->info_ptr)
+    {
+        png_destroy_write_struct(&writer->png_ptr, (png_infopp)NULL);
+        if (writer->fp) fclose(writer->fp);
+        writer->fp = NULL;
+        return false;
+    }
+
+    if (setjmp(png_jmpbuf(writer->png_ptr)))
+    {
+        png_destroy_write_struct(&writer->png_ptr, &writer->info_ptr);
+        if (writer->fp) fclose(writer->fp);
+        writer->fp = NULL;
+        return false;
+    }
+
+    if (writer->fp) png_init_io(writer->png_ptr, writer->fp);
+    else png_set_write_fn(writer->png_ptr, buffer, pngBufferWrite, pngBufferFlush);
+    png_set_compression_level(writer->png_ptr, settings->level);
+    png_set_compression_strategy(writer->png_ptr, settings->strategy);
+    png_set_compression_window_bits(writer->png_ptr, settings->windowBits);
+    png_set_compression_mem_level(writer->png_ptr, settings->memLevel);
+    png_set_filter(writer->png_ptr, PNG_FILTER_TYPE_BASE, settings->filters);
+    png_set_IHDR(writer->png_ptr, writer->info_ptr, width, height,
+                 bitDepth, colorType, PNG_INTERLACE_NONE,
+                 PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    if (colorType == PNG_COLOR_TYPE_PALETTE)
+    {
+        png_set_PLTE(writer->png_ptr, writer->info_ptr, colors, ncolors);
+    }
+    png_write_info(writer->png_ptr, writer->info_ptr);
+    if (bitDepth < 8)
+    {
+        png_set_packing(writer->png_ptr);
+    }
+    return true;
+}
+
+// Writes the next row. A write error (such as a full disk) marks the PNG as failed instead of taking down the
+// process, and later rows are ignored, so the caller can still finish any other file it's writing alongside.
+static void pngWriterRow(PngWriter *writer, const uint8_t *row)
+{
+    if (writer->failed) return;
+    if (setjmp(png_jmpbuf(writer->png_ptr)))
+    {
+        writer->failed = true;
+        return;
+    }
+    png_write_row(writer->png_ptr, (png_bytep) row);
+}
+
+// Gives up on a PNG that is being written, leaving whatever was written so far in the file.
+static void pngWriterAbort(PngWriter *writer)
+{
+    png_destroy_write_struct(&writer->png_ptr, &writer->info_ptr);
+    if (writer->fp) fclose(writer->fp);
+    writer->fp = NULL;
+}
+
+// Finishes the PNG after the last row has been written and closes the file. Returns false if any of it failed to be
+// written, which for a file can also happen at fclose() when the last of it is flushed; the file is incomplete then.
+static bool pngWriterClose(PngWriter *writer)
+{
+    if (writer->failed)
+    {
+        pngWriterAbort(writer);
+        return false;
+    }
+    if (setjmp(png_jmpbuf(writer->png_ptr)))
+    {
+        pngWriterAbort(writer);
+        return false;
+    }
+
+    png_write_end(writer->png_ptr, writer->info_ptr);
+    png_destroy_write_struct(&writer->png_ptr, &writer->info_ptr);
+    bool closed = !writer->fp || fclose(writer->fp) == 0;
+    writer->fp = NULL;
+    return closed;
+}
+
+static void copyAlphaRow(const uint32_t *source, uint8_t *dest, int width)
+{
+    for (int x = 0; x < width; x++)
+    {
+        dest[x] = (source[x] >> 24) & 0xff;
+    }
+}
+
+// Updates the alpha classification so far with one more row of RGBA pixels. Stops looking as soon as it finds a
+// pixel that needs a mask, since nothing after that can change the answer.
+static AlphaType rowAlphaType(const uint32_t *row, int width, AlphaType alphaType)
+{
+    for (int x = 0; x < width; x++)
+    {
+        uint32_t alpha = (row[x] >> 24) & 0xff;
+        if (alpha == 0)
+        {
+            alphaType = ALPHA_SIMPLE;
+        }
+        else if (alpha != 255)
+        {
+            return ALPHA_MASK_NEEDED;
+        }
+    }
+    return alphaType;
+}
+
+// Turns the rows of a source image into palette indices and/or alpha values. An 8-bit indexed source can only use
+// 256 different colors, so unless it's being dithered, each source index is quantized once up front, and rows are
+// then translated with a table lookup. The table is built from exactly what readSourceRow() would return for each
+// index, color key included, so the output is the same either way.
+typedef struct {
+    SDL_Surface *surface;
+    const Palette *pal; // NULL if only alpha is wanted
+    bool hasAlpha;
+    NearestColorCache *cache;
+    uint32_t *rowBuffer;
+    bool indexed;
+    uint8_t remapIndex[256];
+    uint8_t remapAlpha[256];
+    Ditherer dither;
+    ConversionStats *stats; // NULL unless the caller sets it after rowConverterInit()
+} RowConverter;
+
+// Only the metric and dithering mode are taken from options.
+static bool rowConverterInit(RowConverter *rows, SDL_Surface *surface, const Palette *pal,
+                             const ConvertOptions *options, bool hasAlpha)
+{
+    DitherMode dither = pal ? options->dither : DITHER_NONE;
+
+    rows->surface = surface;
+    rows->pal = pal;
+    rows->hasAlpha = hasAlpha;
+    rows->indexed = surface->format->palette && surface->format->BitsPerPixel == 8 && dither == DITHER_NONE;
+    rows->stats = NULL;
+    rows->cache = pal ? newNearestColorCache(pal, options->metric) : NULL;
+    rows->rowBuffer = rows->indexed ? NULL : malloc(surface->w * sizeof(uint32_t));
+    if ((pal && !rows->cache) || (!rows->indexed && !rows->rowBuffer) ||
+        (pal && !ditherInit(&rows->dither, pal, dither, surface->w)))
+    {
+        free(rows->cache);
+        free(rows->rowBuffer);
+        return false;
+    }
+
+    if (rows->indexed)
+    {
+        const SDL_Palette *palette = surface->format->palette;
+        uint32_t colors[256], key;
+        bool hasKey = SDL_GetColorKey(surface, &key) == 0;
+
+        for (int i = 0; i < 256; i++)
+        {
+            SDL_Color color = (i < palette->ncolors) ? palette->colors[i] : (SDL_Color) { 0, 0, 0, 0 };
+            colors[i] = color.r | (color.g << 8) | (color.b << 16) | ((uint32_t) color.a << 24);
+            if (hasKey && (uint32_t) i == key) colors[i] = 0;
+        }
+        if (pal) quantizeRow(pal, rows->cache, colors, rows->remapIndex, 256, hasAlpha, rows->remapAlpha);
+        else copyAlphaRow(colors, rows->remapAlpha, 256);
+    }
+    return true;
+}
+
+static void rowConverterFree(RowConverter *rows)
+{
+    addCacheStats(rows->stats, rows->cache);
+    if (rows->pal) ditherFree(&rows->dither);
+    free(rows->cache);
+    free(rows->rowBuffer);
+}
+
+// Converts row y of the source. Either destination can be NULL; indexDest must be NULL if there is no palette.
+static void convertSourceRow(RowConverter *rows, int y, uint8_t *indexDest, uint8_t *alphaDest)
+{
+    SDL_Surface *surface = rows->surface;
+    ConversionStage stage = indexDest ? STAGE_QUANTIZE : STAGE_CONVERT;
+    Uint64 mark = stageMark(rows->stats);
+    int x;
+
+    if (rows->stats && indexDest) rows->stats->pixelsQuantized += surface->w;
+    if (rows->indexed)
+    {
+        const uint8_t *source = (const uint8_t*) surface->pixels + y * surface->pitch;
+        for (x = 0; indexDest && x < surface->w; x++)
+        {
+            indexDest[x] = rows->remapIndex[source[x]];
+        }
+        for (x = 0; alphaDest && x < surface->w; x++)
+        {
+            alphaDest[x] = rows->remapAlpha[source[x]];
+        }
+        stageLap(rows->stats, stage, &mark);
+        return;
+    }
+
+    const uint32_t *source = readSourceRow(surface, y, rows->rowBuffer);
+    stageLap(rows->stats, STAGE_CONVERT, &mark);
+    if (indexDest)
+    {
+        quantizeImageRow(rows->pal, rows->cache, &rows->dither, source, indexDest, surface->w, y, rows->hasAlpha,
+                         alphaDest);
+    }
+    else if (alphaDest) copyAlphaRow(source, alphaDest, surface->w);
+    stageLap(rows->stats, stage, &mark);
+}
+
+// Images with at least BAND_MIN_PIXELS pixels are quantized BAND_ROWS rows at a time by helper threads, while the
+// thread doing the conversion writes out the band before (and, when streaming, decodes the band after). PNG encoding
+// is one sequential stream per file, but the palette search isn't, so this lets one huge background use the whole
+// machine instead of keeping a single core busy while the rest of a batch has long since finished.
+#define BAND_MIN_PIXELS (2048 * 2048)
+#define BAND_ROWS 64
+#define MAX_BAND_WORKERS 16
+
+struct BandQuantizer;
+
+typedef struct {
+    struct BandQuantizer *owner;
+    SDL_Thread *thread;
+    SDL_sem *start;
+    RowConverter rows;        // for surface sources
+    NearestColorCache *cache; // for decoded rows
+    Ditherer dither;          // for decoded rows; never error diffusion, which can't be split up
+} BandWorker;
+
+// Two sets of band buffers are used in turn, so that one band can be quantized while the other is written out.
+typedef struct BandQuantizer {
+    SDL_Surface *surface;  // the source, or NULL if the rows are decoded into source[] instead
+    const Palette *pal;
+    bool hasAlpha;
+    int width;
+    int height;
+    uint32_t *source[2];   // decoded RGBA rows of a band, if there is no surface
+    uint8_t *indices[2];
+    uint8_t *alpha[2];     // NULL if no mask is being written
+    int current;           // which set of buffers the helpers are working on
+    int bandStart;
+    int bandRows;
+    SDL_atomic_t nextRow;  // the next row of the band that no helper has taken yet
+    SDL_sem *done;         // posted by each helper as it finishes a band
+    bool quit;
+    BandWorker workers[MAX_BAND_WORKERS];
+    int numWorkers;
+    SDL_atomic_t *spareThreads; // where the helpers' CPUs came from, and go back to
+    ConversionStats *stats; // NULL unless the caller sets it after bandQuantizerInit()
+
+    // For decoded rows whose alpha classification is still being worked out: if the caller sets alphaSoFar after
+    // bandQuantizerInit(), hasAlpha is switched on for the first band that starts after it stops being ALPHA_NONE,
+    // and opaqueUsedIndex0 is set if a band quantized before that used index 0.
+    const AlphaType *alphaSoFar;
+    bool opaqueUsedIndex0;
+} BandQuantizer;
+
+typedef enum {
+    BANDS_DONE,
+    BANDS_CANCELED,
+    BANDS_READ_FAILED,
+} BandStatus;
+
+// Fills numRows rows of RGBA pixels starting at firstRow, in order; returns false if the source can't be read.
+typedef bool (*BandReadFunc)(void *context, uint32_t *rows, int firstRow, int numRows);
+
+static void bandConvertRow(BandQuantizer *bands, BandWorker *worker, int r)
+{
+    size_t offset = (size_t) r * bands->width;
+    uint8_t *indexDest = bands->indices[bands->current] + offset;
+    uint8_t *alphaDest = bands->alpha[bands->current] ? bands->alpha[bands->current] + offset : NULL;
+
+    if (bands->surface)
+    {
+        convertSourceRow(&worker->rows, bands->bandStart + r, indexDest, alphaDest);
+    }
+    else
+    {
+        quantizeImageRow(bands->pal, worker->cache, &worker->dither, bands->source[bands->current] + offset, indexDest,
+                         bands->width, bands->bandStart + r, bands->hasAlpha, alphaDest);
+    }
+}
+
+// Each helper keeps taking the next row of the band that nobody has started yet, so a helper that gets held up
+// doesn't hold up the others.
+static int bandWorkerThread(void *data)
+{
+    BandWorker *worker = (BandWorker*) data;
+    BandQuantizer *bands = worker->owner;
+    int r;
+
+    for (;;)
+    {
+        SDL_SemWait(worker->start);
+        if (bands->quit) return 0;
+        while ((r = SDL_AtomicAdd(&bands->nextRow, 1)) < bands->bandRows)
+        {
+            bandConvertRow(bands, worker, r);
+        }
+        SDL_SemPost(bands->done);
+    }
+}
+
+static void bandQuantizerFree(BandQuantizer *bands)
+{
+    int i;
+
+    bands->quit = true;
+    for (i = 0; i < bands->numWorkers; i++)
+    {
+        SDL_SemPost(bands->workers[i].start);
+        SDL_WaitThread(bands->workers[i].thread, NULL);
+    }
+    for (i = 0; i < bands->numWorkers; i++)
+    {
+        BandWorker *worker = &bands->workers[i];
+        SDL_DestroySemaphore(worker->start);
+        if (bands->surface)
+        {
+            // the helpers are gone, so their counters can be added up now
+            worker->rows.stats = bands->stats;
+            rowConverterFree(&worker->rows);
+        }
+        addCacheStats(bands->stats, worker->cache);
+        free(worker->cache);
+        ditherFree(&worker->dither);
+    }
+    if (bands->done) SDL_DestroySemaphore(bands->done);
+    returnHelperThreads(bands->spareThreads, bands->numWorkers);
+    for (i = 0; i < 2; i++)
+    {
+        free(bands->source[i]);
+        free(bands->indices[i]);
+        free(bands->alpha[i]);
+    }
+}
+
+// Sets up the helpers for quantizing an image in bands, one for each CPU that can be taken from
+// options->spareThreads. The rows come from surface, or if it's NULL, from the read function passed to runBands().
+// Returns false if the image is too small to be worth splitting up, no CPU is free to help, the image is dithered by
+// error diffusion (where each row depends on the one above), or something couldn't be allocated, in which case the
+// caller converts the image one row at a time as usual.
+static bool bandQuantizerInit(BandQuantizer *bands, SDL_Surface *surface, int width, int height, const Palette *pal,
+                              const ConvertOptions *options, bool hasAlpha, bool wantAlpha)
+{
+    size_t bandPixels = (size_t) width * BAND_ROWS;
+    int maxWorkers;
+    int i;
+
+    if ((int64_t) width * height < BAND_MIN_PIXELS || isErrorDiffusion(options->dither)) return false;
+    maxWorkers = takeHelperThreads(options->spareThreads, MAX_BAND_WORKERS);
+    if (maxWorkers < 1) return false;
+
+    memset(bands, 0, sizeof(*bands));
+    bands->spareThreads = options->spareThreads;
+    bands->surface = surface;
+    bands->pal = pal;
+    bands->hasAlpha = hasAlpha;
+    bands->width = width;
+    bands->height = height;
+    bands->done = SDL_CreateSemaphore(0);
+    bool ok = bands->done != NULL;
+    for (i = 0; i < 2 && ok; i++)
+    {
+        bands->indices[i] = malloc(bandPixels);
+        if (wantAlpha) bands->alpha[i] = malloc(bandPixels);
+        if (!surface) bands->source[i] = malloc(bandPixels * sizeof(uint32_t));
+        ok = bands->indices[i] && (bands->alpha[i] || !wantAlpha) && (bands->source[i] || surface);
+    }
+
+    // a helper that can't be started just means fewer helpers
+    for (i = 0; i < maxWorkers && ok; i++)
+    {
+        BandWorker *worker = &bands->workers[i];
+        worker->owner = bands;
+        worker->start = SDL_CreateSemaphore(0);
+        if (!worker->start) break;
+        bool ready = surface ? rowConverterInit(&worker->rows, surface, pal, options, hasAlpha)
+                             : (worker->cache = newNearestColorCache(pal, options->metric)) != NULL &&
+                               ditherInit(&worker->dither, pal, options->dither, width);
+        if (!ready)
+        {
+            free(worker->cache);
+            worker->cache = NULL;
+            SDL_DestroySemaphore(worker->start);
+            break;
+        }
+        worker->thread = SDL_CreateThread(bandWorkerThread, "band", worker);
+        if (!worker->thread)
+        {
+            SDL_DestroySemaphore(worker->start);
+            if (surface) rowConverterFree(&worker->rows);
+            free(worker->cache);
+            break;
+        }
+        bands->numWorkers++;
+    }
+
+    // CPUs that didn't get a helper go straight back; bandQuantizerFree() returns the rest
+    returnHelperThreads(options->spareThreads, maxWorkers - bands->numWorkers);
+    if (!ok || bands->numWorkers == 0)
+    {
+        bandQuantizerFree(bands);
+        return false;
+    }
+    return true;
+}
+
+static int bandRowCount(const BandQuantizer *bands, int band)
+{
+    int rows = bands->height - band * BAND_ROWS;
+    return rows < BAND_ROWS ? rows : BAND_ROWS;
+}
+
+// hands a band to the helpers; its source rows must be ready
+static void bandQuantizerStart(BandQuantizer *bands, int band)
+{
+    if (bands->alphaSoFar && !bands->hasAlpha && *bands->alphaSoFar != ALPHA_NONE)
+    {
+        // the helpers are all waiting, so their caches can be cleared from here
+        bands->hasAlpha = true;
+        for (int i = 0; i < bands->numWorkers; i++)
+        {
+            clearNearestColorCache(bands->workers[i].cache);
+        }
+    }
+    bands->current = band & 1;
+    bands->bandStart = band * BAND_ROWS;
+    bands->bandRows = bandRowCount(bands, band);
+    SDL_AtomicSet(&bands->nextRow, 0);
+    for (int i = 0; i < bands->numWorkers; i++)
+    {
+        SDL_SemPost(bands->workers[i].start);
+    }
+}
+
+static void bandQuantizerWait(BandQuantizer *bands)
+{
+    for (int i = 0; i < bands->numWorkers; i++)
+    {
+        SDL_SemWait(bands->done);
+    }
+}
+
+static void writeBand(const BandQuantizer *bands, int band, PngWriter *image, PngWriter *mask)
+{
+    int parity = band & 1;
+
+    for (int r = 0; r < bandRowCount(bands, band); r++)
+    {
+        size_t offset = (size_t) r * bands->width;
+        if (image) pngWriterRow(image, bands->indices[parity] + offset);
+        if (mask) pngWriterRow(mask, bands->alpha[parity] + offset);
+    }
+}
+
+// Quantizes the whole image band by band and writes the rows in order to image and mask (either can be NULL). While
+// the helpers work on band n, this thread writes band n - 1 and reads band n + 1.
+static BandStatus runBands(BandQuantizer *bands, BandReadFunc read, void *readContext, PngWriter *image,
+                           PngWriter *mask, SDL_atomic_t *cancel)
+{
+    int numBands = (bands->height + BAND_ROWS - 1) / BAND_ROWS;
+    BandStatus status = BANDS_DONE;
+    ConversionStats *stats = bands->stats;
+    Uint64 mark = stageMark(stats);
+
+    for (int band = 0; band < 2 && band < numBands && read; band++)
+    {
+        if (!read(readContext, bands->source[band], band * BAND_ROWS, bandRowCount(bands, band)))
+        {
+            return BANDS_READ_FAILED;
+        }
+    }
+    stageLap(stats, STAGE_DECODE, &mark);
+    bandQuantizerStart(bands, 0);
+
+    for (int band = 0; band < numBands; band++)
+    {
+        bandQuantizerWait(bands);
+        if (bands->alphaSoFar && !bands->hasAlpha &&
+            memchr(bands->indices[band & 1], 0, (size_t) bands->width * bandRowCount(bands, band)))
+        {
+            bands->opaqueUsedIndex0 = true;
+        }
+        stageLap(stats, STAGE_QUANTIZE, &mark);
+        if (status == BANDS_DONE && conversionCanceled(cancel)) status = BANDS_CANCELED;
+        if (status != BANDS_DONE) break;
+
+        if (band + 1 < numBands) bandQuantizerStart(bands, band + 1);
+        writeBand(bands, band, image, mask);
+        stageLap(stats, STAGE_ENCODE, &mark);
+        if (stats) stats->pixelsQuantized += (Uint64) bands->width * bandRowCount(bands, band);
+
+        // band's source buffer is free again now that its rows are quantized
+        if (read && band + 2 < numBands &&
+            !read(readContext, bands->source[band & 1], (band + 2) * BAND_ROWS, bandRowCount(bands, band + 2)))
+        {
+            status = BANDS_READ_FAILED;
+        }
+        stageLap(stats, STAGE_DECODE, &mark);
+    }
+    return status;
+}
+
+// Writes the indexed image to imagePath and the alpha mask to maskPath in a single pass over the source, so each row
+// of source pixels is only read once even when both files are wanted. Either path can be NULL to skip that file. If
+// the image can't be created, the mask isn't written either. If the conversion is canceled, both files are left
+// unfinished.
+static void writeImageAndMask(SDL_Surface *screen, bool hasAlpha, const Palette *pal, const char *imagePath,
+                              const char *maskPath, const ConvertOptions *options, bool *imageWritten,
+                              bool *maskWritten)
+{
+    SDL_atomic_t *cancel = options->cancel;
+    ConversionStats *stats = options->stats;
+    PngWriter image, mask;
+    EncodeSettings imageSettings, maskSettings;
+    RowConverter rows;
+    uint8_t *indexLine = NULL, *alphaLine = NULL;
+    bool writeImage = imagePath != NULL, writeMask = maskPath != NULL;
+    int y;
+
+    *imageWritten = false;
+    *maskWritten = false;
+    profileEncodeSettings(options->compression, PNG_COLOR_TYPE_PALETTE, &imageSettings);
+    profileEncodeSettings(options->compression, PNG_COLOR_TYPE_GRAY, &maskSettings);
+
+    if (!rowConverterInit(&rows, screen, writeImage ? pal : NULL, options, hasAlpha)) return;
+    rows.stats = stats;
+
+    if (writeImage)
+    {
+        indexLine = (uint8_t*) malloc(screen->w);
+        if (!indexLine ||
+            !pngWriterOpen(&image, imagePath, NULL, screen->w, screen->h, PNG_COLOR_TYPE_PALETTE,
+                           pal->colors, pal->ncolors, &imageSettings))
+        {
+            free(indexLine);
+            rowConverterFree(&rows);
+            return;
+        }
+    }
+    if (writeMask)
+    {
+        alphaLine = (uint8_t*) malloc(screen->w);
+        if (!alphaLine ||
+            !pngWriterOpen(&mask, maskPath, NULL, screen->w, screen->h, PNG_COLOR_TYPE_GRAY, NULL, 0, &maskSettings))
+        {
+            // still finish the image, so a mask failure doesn't take the image down with it
+            free(alphaLine);
+            alphaLine = NULL;
+            writeMask = false;
+        }
+    }
+    if (!writeImage && !writeMask)
+    {
+        rowConverterFree(&rows);
+        return;
+    }
+
+    // indexed sources are only a table lookup per pixel, so they aren't worth spreading over several threads
+    BandQuantizer bands;
+    if (writeImage && !rows.indexed &&
+        bandQuantizerInit(&bands, screen, screen->w, screen->h, pal, options, hasAlpha, writeMask))
+    {
+        bands.stats = stats;
+        BandStatus status = runBands(&bands, NULL, NULL, &image, writeMask ? &mask : NULL, cancel);
+        bandQuantizerFree(&bands);
+        y = (status == BANDS_DONE) ? screen->h : 0;
+    }
+    else
+    {
+        for (y = 0; y < screen->h && !conversionCanceled(cancel); y++)
+        {
+            convertSourceRow(&rows, y, indexLine, alphaLine);
+            Uint64 mark = stageMark(stats);
+            if (writeImage)
+            {
+                pngWriterRow(&image, indexLine);
+            }
+            if (writeMask)
+            {
+                pngWriterRow(&mask, alphaLine);
+            }
+            stageLap(stats, STAGE_ENCODE, &mark);
+        }
+    }
+
+    bool finished = (y == screen->h);
+    Uint64 mark = stageMark(stats);
+    if (writeImage)
+    {
+        if (finished) *imageWritten = pngWriterClose(&image);
+        else pngWriterAbort(&image);
+    }
+    if (writeMask)
+    {
+        if (finished) *maskWritten = pngWriterClose(&mask);
+        else pngWriterAbort(&mask);
+    }
+    stageLap(stats, STAGE_ENCODE, &mark);
+    if (stats && finished) stats->rawBytes += (Uint64) screen->w * screen->h * (writeImage + writeMask);
+    free(alphaLine);
+    free(indexLine);
+    rowConverterFree(&rows);
+}
+
+// Encodings the optimizer tries on top of the one the selected compression profile would produce. Which of these
+// wins depends a lot on the image: flat sprites like RLE or no filtering, photos and gradients like Paeth.
+static const EncodeSettings optimizeCandidates[] = {
+    { Z_BEST_COMPRESSION, Z_DEFAULT_STRATEGY, 15, 9, PNG_FILTER_NONE },
+    { Z_BEST_COMPRESSION, Z_FILTERED,         15, 9, PNG_FILTER_NONE },
+    { Z_BEST_COMPRESSION, Z_RLE,              15, 9, PNG_FILTER_NONE },
+    { Z_BEST_COMPRESSION, Z_DEFAULT_STRATEGY, 15, 9, PNG_FILTER_SUB },
+    { Z_BEST_COMPRESSION, Z_DEFAULT_STRATEGY, 15, 9, PNG_FILTER_UP },
+    { Z_BEST_COMPRESSION, Z_DEFAULT_STRATEGY, 15, 9, PNG_FILTER_PAETH },
+    { Z_BEST_COMPRESSION, Z_DEFAULT_STRATEGY, 15, 9, PNG_ALL_FILTERS },
+    { Z_BEST_COMPRESSION, Z_FILTERED,         15, 9, PNG_ALL_FILTERS },
+    { Z_BEST_COMPRESSION, Z_RLE,              15, 9, PNG_ALL_FILTERS },
+};
+
+#define NUM_OPTIMIZE_CANDIDATES ((int)(sizeof(optimizeCandidates) / sizeof(optimizeCandidates[0])))
+
+// The same image with a particular palette layout.
+typedef struct {
+    const uint8_t *pixels;
+    const png_color *colors;
+    int ncolors;
+} PixelLayout;
+
+typedef struct {
+    const PixelLayout *layout;
+    EncodeSettings settings;
+    PngBuffer output;
+    bool ok;
+} OptimizeTrial;
+
+typedef struct {
+    int width;
+    int height;
+    int colorType;
+    OptimizeTrial *trials;
+    int numTrials;
+    SDL_atomic_t nextTrial;
+    SDL_atomic_t *cancel;
+} Optimizer;
+
+static void runOptimizeTrial(Optimizer *optimizer, OptimizeTrial *trial)
+{
+    PngWriter writer;
+    const PixelLayout *layout = trial->layout;
+
+    if (!pngWriterOpen(&writer, NULL, &trial->output, optimizer->width, optimizer->height, optimizer->colorType,
+                       layout->colors, layout->ncolors, &trial->settings))
+    {
+        return;
+    }
+    for (int y = 0; y < optimizer->height; y++)
+    {
+        if (conversionCanceled(optimizer->cancel))
+        {
+            pngWriterAbort(&writer);
+            return;
+        }
+        pngWriterRow(&writer, layout->pixels + (size_t) y * optimizer->width);
+    }
+    trial->ok = pngWriterClose(&writer) && !trial->output.failed;
+}
+
+// Each thread keeps taking the next trial that nobody has started yet until there are none left.
+static int optimizerThread(void *data)
+{
+    Optimizer *optimizer = (Optimizer*) data;
+    int i;
+
+    while ((i = SDL_AtomicAdd(&optimizer->nextTrial, 1)) < optimizer->numTrials)
+    {
+        runOptimizeTrial(optimizer, &optimizer->trials[i]);
+    }
     return 0;
+}
+
+// Renumbers the palette so that the most used colors come first, which gives deflate more repeated byte values to
+// work with. Index 0 stays where it is because it's the transparent color, and unused colors are dropped. Returns
+// the new number of colors.
+static int reorderPaletteByUse(const uint8_t *pixels, size_t count, const size_t *uses, const png_color *colors,
+                               int ncolors, uint8_t *newPixels, png_color *newColors)
+{
+    int order[256];
+    uint8_t remap[256];
+    int i, j, numUsed = 0;
+
+    for (i = 1; i < ncolors; i++)
+    {
+        if (uses[i] == 0) continue;
+
+        // insertion sort, most used first; equally used colors keep their original order
+        for (j = numUsed; j > 0 && uses[order[j - 1]] < uses[i]; j--)
+        {
+            order[j] = order[j - 1];
+        }
+        order[j] = i;
+        numUsed++;
+    }
+
+    newColors[0] = colors[0];
+    remap[0] = 0;
+    for (i = 0; i < numUsed; i++)
+    {
+        newColors[i + 1] = colors[order[i]];
+        remap[order[i]] = i + 1;
+    }
+    for (size_t k = 0; k < count; k++)
+    {
+        newPixels[k] = remap[pixels[k]];
+    }
+    return numUsed + 1;
+}
+
+// Encodes an 8-bit indexed or grayscale image every way the optimizer knows, on this thread plus a helper for each CPU
+// that can be taken from spareThreads (see ConvertOptions), and saves whichever encoding came out smallest. For
+// indexed images, unused colors at the end of the palette are dropped, and if reorderPalette is set, a layout with the
+// palette sorted by use is tried as well. Adds the number of bytes saved compared to the plain compression profile to
+// *bytesSaved. Nothing is saved if the conversion is canceled.
+static bool saveOptimizedPNG(const char *path, const uint8_t *pixels, int width, int height, int colorType,
+                             const png_color *colors, int ncolors, CompressionProfile compression,
+                             bool reorderPalette, SDL_atomic_t *cancel, SDL_atomic_t *spareThreads, long *bytesSaved)
+{
+    size_t count = (size_t) width * height;
+    PixelLayout layouts[3];
+    int numLayouts = 0;
+    uint8_t *reorderedPixels = NULL;
+    png_color reorderedColors[256];
+    int i;
+
+    // the profile's own encoding, unchanged, is what the savings are measured against
+    layouts[numLayouts++] = (PixelLayout) { pixels, colors, ncolors };
+    if (colorType == PNG_COLOR_TYPE_PALETTE)
+    {
+        size_t uses[256] = {0};
+        int numColorsUsed = 1;
+        for (size_t k = 0; k < count; k++)
+        {
+            uses[pixels[k]]++;
+        }
+        for (i = 1; i < ncolors; i++)
+        {
+            if (uses[i]) numColorsUsed = i + 1;
+        }
+        layouts[numLayouts++] = (PixelLayout) { pixels, colors, numColorsUsed };
+
+        if (reorderPalette && (reorderedPixels = malloc(count)))
+        {
+            int reorderedCount = reorderPaletteByUse(pixels, count, uses, colors, ncolors, reorderedPixels,
+                                                     reorderedColors);
+            layouts[numLayouts++] = (PixelLayout) { reorderedPixels, reorderedColors, reorderedCount };
+        }
+    }
+
+    // grayscale images only have the one layout, which gets the candidates as well as the profile's settings
+    const PixelLayout *candidateLayouts = (numLayouts > 1) ? &layouts[1] : &layouts[0];
+    int numCandidateLayouts = (numLayouts > 1) ? numLayouts - 1 : 1;
+
+    Optimizer optimizer;
+    optimizer.width = width;
+    optimizer.height = height;
+    optimizer.colorType = colorType;
+    optimizer.cancel = cancel;
+    optimizer.numTrials = 1 + numCandidateLayouts * NUM_OPTIMIZE_CANDIDATES;
+    optimizer.trials = calloc(optimizer.numTrials, sizeof(OptimizeTrial));
+    SDL_AtomicSet(&optimizer.nextTrial, 0);
+    if (!optimizer.trials)
+    {
+        free(reorderedPixels);
+        return false;
+    }
+
+    optimizer.trials[0].layout = &layouts[0];
+    profileEncodeSettings(compression, colorType, &optimizer.trials[0].settings);
+    for (i = 0; i < optimizer.numTrials - 1; i++)
+    {
+        optimizer.trials[i + 1].layout = &candidateLayouts[i / NUM_OPTIMIZE_CANDIDATES];
+        optimizer.trials[i + 1].settings = optimizeCandidates[i % NUM_OPTIMIZE_CANDIDATES];
+    }
+
+    // this thread works through the trials too, so with no CPU to spare they just run one after another here
+    SDL_Thread *threads[64];
+    int numThreads = takeHelperThreads(spareThreads, optimizer.numTrials - 1 < 64 ? optimizer.numTrials - 1 : 64);
+    for (i = 0; i < numThreads; i++)
+    {
+        threads[i] = SDL_CreateThread(optimizerThread, "optimizer", &optimizer);
+    }
+    optimizerThread(&optimizer);
+    for (i = 0; i < numThreads; i++)
+    {
+        if (threads[i]) SDL_WaitThread(threads[i], NULL);
+    }
+    returnHelperThreads(spareThreads, numThreads);
+
+    const OptimizeTrial *best = NULL;
+    for (i = 0; i < optimizer.numTrials && !conversionCanceled(cancel); i++)
+    {
+        const OptimizeTrial *trial = &optimizer.trials[i];
+        if (trial->ok && (!best || trial->output.size < best->output.size)) best = trial;
+    }
+
+    bool ok = false;
+    FILE *fp = best ? fopen(path, "wb") : NULL;
+    if (fp)
+    {
+        ok = fwrite(best->output.data, 1, best->output.size, fp) == best->output.size;
+        ok = (fclose(fp) == 0) && ok;
+    }
+    if (ok && optimizer.trials[0].ok)
+    {
+        *bytesSaved += (long) optimizer.trials[0].output.size - (long) best->output.size;
+    }
+
+    for (i = 0; i < optimizer.numTrials; i++)
+    {
+        free(optimizer.trials[i].output.data);
+    }
+    free(optimizer.trials);
+    free(reorderedPixels);
+    return ok;
+}
+
+// Optimize-mode counterpart of writeImageAndMask(). The whole image has to be quantized up front so that it can be
+// encoded several times over.
+static void writeImageAndMaskOptimized(SDL_Surface *screen, bool hasAlpha, const Palette *pal, const char *imagePath,
+                                       const char *maskPath, const ConvertOptions *options, bool *imageWritten,
+                                       bool *maskWritten, long *bytesSaved)
+{
+    size_t count = (size_t) screen->w * screen->h;
+    RowConverter rows;
+    uint8_t *indices = NULL, *alpha = NULL;
+    int y;
+
+    *imageWritten = false;
+    *maskWritten = false;
+    *bytesSaved = 0;
+
+    if (!rowConverterInit(&rows, screen, imagePath ? pal : NULL, options, hasAlpha)) return;
+    rows.stats = options->stats;
+    if (imagePath)
+    {
+        indices = (uint8_t*) malloc(count);
+    }
+    if (maskPath)
+    {
+        alpha = (uint8_t*) malloc(count);
+    }
+    if ((imagePath && !indices) || (maskPath && !alpha))
+    {
+        goto done;
+    }
+
+    for (y = 0; y < screen->h; y++)
+    {
+        if (conversionCanceled(options->cancel)) goto done;
+        convertSourceRow(&rows, y, indices ? indices + (size_t) y * screen->w : NULL,
+                         alpha ? alpha + (size_t) y * screen->w : NULL);
+    }
+
+    // the trial encodings run in parallel, so this is the wall time of all of them together
+    Uint64 mark = stageMark(options->stats);
+    if (imagePath)
+    {
+        *imageWritten = saveOptimizedPNG(imagePath, indices, screen->w, screen->h, PNG_COLOR_TYPE_PALETTE,
+                                         pal->colors, pal->ncolors, options->compression, options->reorderPalette,
+                                         options->cancel, options->spareThreads, bytesSaved);
+        if (!*imageWritten) goto done;
+    }
+    if (maskPath)
+    {
+        *maskWritten = saveOptimizedPNG(maskPath, alpha, screen->w, screen->h, PNG_COLOR_TYPE_GRAY, NULL, 0,
+                                        options->compression, false, options->cancel, options->spareThreads,
+                                        bytesSaved);
+    }
+    stageLap(options->stats, STAGE_ENCODE, &mark);
+    if (options->stats) options->stats->rawBytes += count * (*imageWritten + *maskWritten);
+
+done:
+    free(alpha);
+    free(indices);
+    rowConverterFree(&rows);
+}
+
+// A PNG being decoded one row at a time, straight into the RGBA layout readSourceRow() produces. Only images that
+// libpng alone can decode to exactly the pixels IMG_Load() gives are accepted: non-interlaced 8 or 16-bit grayscale or
+// truecolor, with or without an alpha channel, and without a tRNS chunk (whose color key SDL_image handles itself).
+typedef struct {
+    FILE *fp;
+    png_structp png_ptr;
+    png_infop info_ptr;
+    int width;
+    int height;
+    bool hasAlphaChannel;
+} PngStream;
+
+// returns false, with nothing left open, if the file can't be read or isn't a PNG this can stream
+static bool pngStreamOpen(PngStream *stream, const char *path)
+{
+    png_byte signature[8];
+    png_uint_32 width, height;
+    int bitDepth, colorType, interlaceType;
+
+    stream->fp = fopen(path, "rb");
+    if (!stream->fp) return false;
+    stream->png_ptr = NULL;
+    stream->info_ptr = NULL;
+    if (fread(signature, 1, sizeof(signature), stream->fp) != sizeof(signature) ||
+        png_sig_cmp(signature, 0, sizeof(signature)) != 0)
+    {
+        fclose(stream->fp);
+        return false;
+    }
+    stream->png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    if (stream->png_ptr) stream->info_ptr = png_create_info_struct(stream->png_ptr);
+    if (!stream->info_ptr)
+    {
+        png_destroy_read_struct(&stream->png_ptr, NULL, NULL);
+        fclose(stream->fp);
+        return false;
+    }
+    if (setjmp(png_jmpbuf(stream->png_ptr)))
+    {
+        png_destroy_read_struct(&stream->png_ptr, &stream->info_ptr, NULL);
+        fclose(stream->fp);
+        return false;
+    }
+
+    png_init_io(stream->png_ptr, stream->fp);
+    png_set_sig_bytes(stream->png_ptr, sizeof(signature));
+    png_read_info(stream->png_ptr, stream->info_ptr);
+    png_get_IHDR(stream->png_ptr, stream->info_ptr, &width, &height, &bitDepth, &colorType, &interlaceType,
+                 NULL, NULL);
+    if (interlaceType != PNG_INTERLACE_NONE || bitDepth < 8 || (colorType & PNG_COLOR_MASK_PALETTE) ||
+        png_get_valid(stream->png_ptr, stream->info_ptr, PNG_INFO_tRNS))
+    {
+        png_destroy_read_struct(&stream->png_ptr, &stream->info_ptr, NULL);
+        fclose(stream->fp);
+        return false;
+    }
+
+    stream->width = width;
+    stream->height = height;
+    stream->hasAlphaChannel = (colorType & PNG_COLOR_MASK_ALPHA) != 0;
+
+    // 16-bit samples are cut down to their high byte, the same as SDL_image does
+    png_set_strip_16(stream->png_ptr);
+    if (!(colorType & PNG_COLOR_MASK_COLOR)) png_set_gray_to_rgb(stream->png_ptr);
+#if SDL_BYTEORDER == SDL_LIL_ENDIAN
+    if (!stream->hasAlphaChannel) png_set_filler(stream->png_ptr, 0xff, PNG_FILLER_AFTER);
+#else
+    png_set_bgr(stream->png_ptr);
+    if (stream->hasAlphaChannel) png_set_swap_alpha(stream->png_ptr);
+    else png_set_filler(stream->png_ptr, 0xff, PNG_FILLER_BEFORE);
+#endif
+    png_read_update_info(stream->png_ptr, stream->info_ptr);
+    return true;
+}
+
+// returns false if the file turns out to be truncated or corrupt
+static bool pngStreamReadRow(PngStream *stream, uint32_t *row)
+{
+    if (setjmp(png_jmpbuf(stream->png_ptr))) return false;
+    png_read_row(stream->png_ptr, (png_bytep) row, NULL);
+    return true;
+}
+
+static void pngStreamClose(PngStream *stream)
+{
+    png_destroy_read_struct(&stream->png_ptr, &stream->info_ptr, NULL);
+    fclose(stream->fp);
+}
+
+typedef struct {
+    PngStream *stream;
+    AlphaType *alphaType;
+} StreamBandReader;
+
+// BandReadFunc for streamed PNGs; classifies the alpha channel of the rows as they are read
+static bool streamReadBand(void *context, uint32_t *rows, int firstRow, int numRows)
+{
+    StreamBandReader *reader = (StreamBandReader*) context;
+    PngStream *stream = reader->stream;
+    (void) firstRow; // the stream is always at the next row
+
+    for (int r = 0; r < numRows; r++)
+    {
+        uint32_t *row = rows + (size_t) r * stream->width;
+        if (!pngStreamReadRow(stream, row)) return false;
+        if (stream->hasAlphaChannel && *reader->alphaType != ALPHA_MASK_NEEDED)
+        {
+            *reader->alphaType = rowAlphaType(row, stream->width, *reader->alphaType);
+        }
+    }
+    return true;
+}
+
+typedef enum {
+    STREAM_UNSUPPORTED, // not a PNG that can be streamed; nothing was written
+    STREAM_READ_FAILED, // the PNG was corrupt part way through
+    STREAM_CANCELED,    // the conversion was canceled part way through
+    STREAM_DONE,
+} StreamStatus;
+
+// One pass of streamConvertPNG(). Writes whichever of imagePath and maskPath aren't NULL, and classifies the alpha
+// channel along the way. The mask is skipped if the image has no alpha channel at all.
+//
+// Unless knownAlpha is set, rows are quantized with the whole palette until the first one with any transparency, and
+// with index 0 kept for transparent pixels from then on. If an earlier row used index 0, *stale is set, and the image
+// has to be converted again with knownAlpha to come out right.
+static StreamStatus streamConvertPass(const char *inputPath, const Palette *pal, bool knownAlpha,
+                                      const char *imagePath, const char *maskPath, const ConvertOptions *options,
+                                      bool *stale, AlphaType *alphaType, bool *imageWritten, bool *maskWritten)
+{
+    SDL_atomic_t *cancel = options->cancel;
+    ConversionStats *stats = options->stats;
+    PngStream stream;
+    PngWriter image, mask;
+    EncodeSettings imageSettings, maskSettings;
+    NearestColorCache *cache = NULL;
+    Ditherer dither = { DITHER_NONE };
+    uint32_t *row;
+    uint8_t *indexLine = NULL, *alphaLine;
+    StreamStatus status = STREAM_DONE;
+    int y;
+
+    *imageWritten = false;
+    *maskWritten = false;
+    if (!pngStreamOpen(&stream, inputPath)) return STREAM_UNSUPPORTED;
+
+    bool writeImage = imagePath != NULL, writeMask = maskPath != NULL && stream.hasAlphaChannel;
+    bool hasAlpha = knownAlpha && stream.hasAlphaChannel;
+    bool opaqueUsedIndex0 = false;
+    *stale = false;
+    *alphaType = ALPHA_NONE;
+    profileEncodeSettings(options->compression, PNG_COLOR_TYPE_PALETTE, &imageSettings);
+    profileEncodeSettings(options->compression, PNG_COLOR_TYPE_GRAY, &maskSettings);
+
+    row = malloc(stream.width * sizeof(uint32_t));
+    alphaLine = malloc(stream.width);
+    if (writeImage)
+    {
+        cache = newNearestColorCache(pal, options->metric);
+        indexLine = malloc(stream.width);
+    }
+    if (!row || !alphaLine || (writeImage && (!cache || !indexLine)) ||
+        (writeImage && !ditherInit(&dither, pal, options->dither, stream.width)))
+    {
+        status = STREAM_UNSUPPORTED;
+        goto done;
+    }
+
+    if (writeImage && !pngWriterOpen(&image, imagePath, NULL, stream.width, stream.height, PNG_COLOR_TYPE_PALETTE,
+                                     pal->colors, pal->ncolors, &imageSettings))
+    {
+        goto done;
+    }
+    if (writeMask && !pngWriterOpen(&mask, maskPath, NULL, stream.width, stream.height, PNG_COLOR_TYPE_GRAY,
+                                    NULL, 0, &maskSettings))
+    {
+        writeMask = false;
+    }
+
+    BandQuantizer bands;
+    if (writeImage &&
+        bandQuantizerInit(&bands, NULL, stream.width, stream.height, pal, options, hasAlpha, writeMask))
+    {
+        StreamBandReader reader = { &stream, alphaType };
+        bands.stats = stats;
+        if (!hasAlpha && stream.hasAlphaChannel) bands.alphaSoFar = alphaType;
+        BandStatus bandStatus = runBands(&bands, streamReadBand, &reader, &image, writeMask ? &mask : NULL, cancel);
+        hasAlpha = bands.hasAlpha;
+        opaqueUsedIndex0 = bands.opaqueUsedIndex0;
+        bandQuantizerFree(&bands);
+        if (bandStatus == BANDS_CANCELED) status = STREAM_CANCELED;
+        else if (bandStatus == BANDS_READ_FAILED) status = STREAM_READ_FAILED;
+    }
+    else
+    {
+        Uint64 mark = stageMark(stats);
+        for (y = 0; y < stream.height; y++)
+        {
+            if (conversionCanceled(cancel))
+            {
+                status = STREAM_CANCELED;
+                break;
+            }
+            if (!pngStreamReadRow(&stream, row))
+            {
+                status = STREAM_READ_FAILED;
+                break;
+            }
+            stageLap(stats, STAGE_DECODE, &mark);
+            if (stream.hasAlphaChannel && *alphaType != ALPHA_MASK_NEEDED)
+            {
+                *alphaType = rowAlphaType(row, stream.width, *alphaType);
+            }
+            if (writeImage)
+            {
+                stageLap(stats, STAGE_CONVERT, &mark);
+                if (!hasAlpha && *alphaType != ALPHA_NONE)
+                {
+                    // the first transparent pixel; from here on, index 0 is only for transparent pixels
+                    hasAlpha = true;
+                    clearNearestColorCache(cache);
+                }
+                quantizeImageRow(pal, cache, &dither, row, indexLine, stream.width, y, hasAlpha, alphaLine);
+                if (!hasAlpha && memchr(indexLine, 0, stream.width)) opaqueUsedIndex0 = true;
+                stageLap(stats, STAGE_QUANTIZE, &mark);
+                pngWriterRow(&image, indexLine);
+            }
+            else
+            {
+                copyAlphaRow(row, alphaLine, stream.width);
+                stageLap(stats, STAGE_CONVERT, &mark);
+            }
+            if (writeMask)
+            {
+                pngWriterRow(&mask, alphaLine);
+            }
+            stageLap(stats, STAGE_ENCODE, &mark);
+        }
+        if (stats && writeImage) stats->pixelsQuantized += (Uint64) stream.width * y;
+    }
+
+    Uint64 mark = stageMark(stats);
+    if (status == STREAM_DONE)
+    {
+        *imageWritten = writeImage && pngWriterClose(&image);
+        *maskWritten = writeMask && pngWriterClose(&mask);
+        *stale = *imageWritten && hasAlpha && opaqueUsedIndex0;
+        if (stats) stats->rawBytes += (Uint64) stream.width * stream.height * (writeImage + writeMask);
+    }
+    else
+    {
+        if (writeImage) pngWriterAbort(&image);
+        if (writeMask) pngWriterAbort(&mask);
+    }
+    stageLap(stats, STAGE_ENCODE, &mark);
 
-error:
-    return 1;
+done:
+    addCacheStats(stats, cache);
+    ditherFree(&dither);
+    free(indexLine);
+    free(cache);
+    free(alphaLine);
+    free(row);
+    pngStreamClose(&stream);
+    return status;
 }
 
+static char *partialPath(const char *path)
+{
+    size_t length = strlen(path) + sizeof(".part");
+    char *result = malloc(length);
+    if (result) snprintf(result, length, "%s.part", path);
+    return result;
+}
+
+// Replaces path with the finished file at tempPath in one step, so that path always holds either the old file or the
+// new one. rename() does that on POSIX, but refuses to replace an existing file on Windows. Sets errno on failure.
+static bool replaceFile(const char *tempPath, const char *path)
+{
+#ifdef _WIN32
+    if (MoveFileExA(tempPath, path, MOVEFILE_REPLACE_EXISTING)) return true;
+    switch (GetLastError())
+    {
+        case ERROR_ACCESS_DENIED:
+        case ERROR_SHARING_VIOLATION:
+            errno = EACCES;
+            break;
+        case ERROR_FILE_NOT_FOUND:
+        case ERROR_PATH_NOT_FOUND:
+            errno = ENOENT;
+            break;
+        default:
+            errno = EIO;
+    }
+    return false;
+#else
+    return rename(tempPath, path) == 0;
+#endif
+}
+
+// adds the size of a saved file to stats->bytesWritten
+static void countSavedFile(ConversionStats *stats, const char *path, bool saved)
+{
+    if (!stats || !saved) return;
+    FILE *fp = fopen(path, "rb");
+    if (!fp) return;
+    if (fseek(fp, 0, SEEK_END) == 0)
+    {
+        long size = ftell(fp);
+        if (size > 0) stats->bytesWritten += size;
+    }
+    fclose(fp);
+}
+
+// points result->error at a message formatted into result->errorText
+static void setResultError(ConvertResult *result, const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    vsnprintf(result->errorText, sizeof(result->errorText), format, args);
+    va_end(args);
+    result->error = result->errorText;
+}
+
+// Moves a file that was written under a temporary name into place if it was finished, or deletes it if it wasn't, so
+// path never holds a partly written file. Returns true if path now holds the new file. If a finished file can't be
+// moved into place, it is left under its temporary name rather than thrown away, and result->error says so.
+static bool finishPartialFile(const char *tempPath, const char *path, bool finished, ConvertResult *result)
+{
+    if (tempPath == NULL) return false;
+    if (finished)
+    {
+        if (replaceFile(tempPath, path)) return true;
+        setResultError(result, "couldn't replace %s (%s); the new file was kept as %s", path, strerror(errno),
+                       tempPath);
+        return false;
+    }
+    remove(tempPath);
+    return false;
+}
+
+// Converts a PNG without ever holding the whole image in memory. Whether index 0 is kept for transparent pixels depends
+// on the alpha classification, which isn't known until the last row has been read, so rows are quantized with the
+// whole palette until the first transparent pixel turns up (see streamConvertPass()). Only if some row before that
+// used index 0 is the image converted again, and the mask from the first pass is kept. Both files are written under
+// temporary names; the mask is only kept if the image turned out to need one. Returns STREAM_UNSUPPORTED if the file
+// has to go through readSourceImage() instead.
+static StreamStatus streamConvertPNG(const char *inputPath, const Palette *pal, const ConvertOptions *options,
+                                     const char *outputPath, const char *maskPath, ConvertResult *result)
+{
+    char *imageTemp = options->writeImage ? partialPath(outputPath) : NULL;
+    char *maskTemp = (options->writeMask && maskPath) ? partialPath(maskPath) : NULL;
+    bool stale, imageDone, maskDone, noMask;
+    StreamStatus status = STREAM_UNSUPPORTED;
+
+    if ((options->writeImage && !imageTemp) || (options->writeMask && maskPath && !maskTemp)) goto done;
+
+    status = streamConvertPass(inputPath, pal, false, imageTemp, maskTemp, options, &stale, &result->alphaType,
+                               &imageDone, &maskDone);
+    if (status == STREAM_DONE && stale)
+    {
+        status = streamConvertPass(inputPath, pal, true, imageTemp, NULL, options, &stale, &result->alphaType,
+                                   &imageDone, &noMask);
+    }
+    if (status == STREAM_DONE && conversionCanceled(options->cancel))
+    {
+        status = STREAM_CANCELED;
+    }
+    if (status != STREAM_DONE)
+    {
+        if (status == STREAM_READ_FAILED)
+        {
+            SDL_SetError("Error reading the PNG file.");
+        }
+        else if (status == STREAM_CANCELED)
+        {
+            result->sourceRead = true;
+            result->canceled = true;
+        }
+        if (status != STREAM_UNSUPPORTED)
+        {
+            finishPartialFile(imageTemp, outputPath, false, result);
+            finishPartialFile(maskTemp, maskPath, false, result);
+        }
+        goto done;
+    }
+
+    result->sourceRead = true;
+    result->maskNeeded = (result->alphaType == ALPHA_MASK_NEEDED);
+    result->imageWritten = finishPartialFile(imageTemp, outputPath, imageDone, result);
+    result->maskWritten = finishPartialFile(maskTemp, maskPath, maskDone && result->maskNeeded, result);
+    countSavedFile(options->stats, outputPath, result->imageWritten);
+    countSavedFile(options->stats, maskPath, result->maskWritten);
+
+done:
+    free(imageTemp);
+    free(maskTemp);
+    return status;
+}
+
+// Maps every pixel of the image to a palette index by the same rules as saveIndexedPNG(), into indices (width *
+// height bytes, row after row). Returns false if it runs out of memory.
+bool quantizeImage(const SourceImage *img, const Palette *pal, uint8_t *indices)
+{
+    SDL_Surface *surface = img->surface;
+    RowConverter rows;
+
+    ConvertOptions options;
+    defaultConvertOptions(&options);
+    if (!rowConverterInit(&rows, surface, pal, &options, sourceHasAlpha(img))) return false;
+    for (int y = 0; y < surface->h; y++)
+    {
+        convertSourceRow(&rows, y, indices + (size_t) y * surface->w, NULL);
+    }
+    rowConverterFree(&rows);
+    return true;
+}
+
+// Saves palette indices from quantizeImage() as an indexed PNG with the default compression profile. Only the
+// encoding is done here, which is what the benchmark needs to time it apart from the quantization.
+bool saveIndices(const char *path, const uint8_t *indices, int width, int height, const Palette *pal)
+{
+    PngWriter writer;
+    EncodeSettings settings;
+    ConvertOptions options;
+
+    defaultConvertOptions(&options);
+    profileEncodeSettings(options.compression, PNG_COLOR_TYPE_PALETTE, &settings);
+    if (!pngWriterOpen(&writer, path, NULL, width, height, PNG_COLOR_TYPE_PALETTE, pal->colors, pal->ncolors,
+                       &settings))
+    {
+        return false;
+    }
+    for (int y = 0; y < height; y++)
+    {
+        pngWriterRow(&writer, indices + (size_t) y * width);
+    }
+    return pngWriterClose(&writer);
+}
+
+// saves image as indexed PNG using nearest-color algorithm; index 0 is only reserved for transparent pixels if the
+// alpha classification says the image has any
+bool saveIndexedPNG(const char *path, const SourceImage *img, const Palette *pal)
+{
+    bool imageWritten, maskWritten;
+    ConvertOptions options;
+    defaultConvertOptions(&options);
+    writeImageAndMask(img->surface, sourceHasAlpha(img), pal, path, NULL, &options, &imageWritten, &maskWritten);
+    return imageWritten;
+}
+
+// saves alpha mask of image
+bool saveMask(const char* filename, const SourceImage *img)
+{
+    bool imageWritten, maskWritten;
+    ConvertOptions options;
+    defaultConvertOptions(&options);
+    writeImageAndMask(img->surface, sourceHasAlpha(img), NULL, NULL, filename, &options, &imageWritten, &maskWritten);
+    return maskWritten;
+}
+
+// returns true if and only if alpha channel of img has at least one alpha value that isn't 0 or 255
+AlphaType alphaType(SDL_Surface *img)
+{
+    int y;
+    AlphaType alphaType = ALPHA_NONE;
+
+    if (!img->format->Amask) return ALPHA_NONE;
+
+    uint32_t *rowBuffer = malloc(img->w * sizeof(uint32_t));
+    if (!rowBuffer) return ALPHA_MASK_NEEDED; // can't tell, so assume the worst
+
+    for (y = 0; y < img->h && alphaType != ALPHA_MASK_NEEDED; y++)
+    {
+        alphaType = rowAlphaType(readSourceRow(img, y, rowBuffer), img->w, alphaType);
+    }
+
+    free(rowBuffer);
+    return alphaType;
+}
+
+void defaultConvertOptions(ConvertOptions *options)
+{
+    options->writeImage = true;
+    options->writeMask = true;
+    options->compression = COMPRESSION_SMALLEST;
+    options->metric = COLOR_METRIC_RGB;
+    options->dither = DITHER_NONE;
+    options->optimize = false;
+    options->reorderPalette = false;
+    options->cancel = NULL;
+    options->spareThreads = NULL;
+    options->stats = NULL;
+}
+
+// sets result->error and returns false if a file that should have been written wasn't
+static bool checkFilesWritten(const ConvertOptions *options, const char *outputPath, const char *maskPath,
+                              ConvertResult *result)
+{
+    if (result->canceled)
+    {
+        result->error = "canceled";
+        return false;
+    }
+
+    // already set if a finished file couldn't be moved into place
+    if (result->error) return false;
+
+    if (options->writeImage && !result->imageWritten)
+    {
+        setResultError(result, "failed to save image %s", outputPath);
+        return false;
+    }
+
+    if (result->maskNeeded && options->writeMask && maskPath != NULL && !result->maskWritten)
+    {
+        setResultError(result, "failed to save alpha mask %s", maskPath);
+        return false;
+    }
+
+    return true;
+}
+
+// Converts a source image with the given palette, saving the indexed image to outputPath and, if the source has
+// non-trivial alpha, the alpha mask to maskPath. maskPath can be NULL if no mask should be written. Returns false on
+// failure, with the reason in result->error.
+//
+// Both files are written under temporary names and only renamed into place once they are complete, so a failed or
+// canceled conversion never leaves a truncated PNG behind. If options->cancel is set while the conversion runs, it
+// stops at the next row, saves nothing, and sets result->canceled.
+//
+// Images of BAND_MIN_PIXELS or more are quantized on helper threads a band of rows at a time, with one per spare CPU.
+bool convertImage(const SourceImage *img, const Palette *pal, const ConvertOptions *options,
+                  const char *outputPath, const char *maskPath, ConvertResult *result)
+{
+    result->alphaType = img->alphaType;
+    result->maskNeeded = (result->alphaType == ALPHA_MASK_NEEDED);
+    result->imageWritten = false;
+    result->maskWritten = false;
+    result->bytesSaved = 0;
+    result->sourceRead = true;
+    result->canceled = false;
+    result->error = NULL;
+
+    bool writeMask = result->maskNeeded && options->writeMask && maskPath != NULL;
+    char *imageTemp = options->writeImage ? partialPath(outputPath) : NULL;
+    char *maskTemp = writeMask ? partialPath(maskPath) : NULL;
+    bool imageDone = false, maskDone = false;
+    bool tempPathsReady = (imageTemp || !options->writeImage) && (maskTemp || !writeMask);
+    if (tempPathsReady && options->optimize)
+    {
+        writeImageAndMaskOptimized(img->surface, sourceHasAlpha(img), pal, imageTemp, maskTemp, options, &imageDone,
+                                   &maskDone, &result->bytesSaved);
+    }
+    else if (tempPathsReady)
+    {
+        writeImageAndMask(img->surface, sourceHasAlpha(img), pal, imageTemp, maskTemp, options, &imageDone, &maskDone);
+    }
+
+    // a conversion canceled after its last row still counts as canceled, so that it saves nothing either way
+    result->canceled = conversionCanceled(options->cancel);
+    result->imageWritten = finishPartialFile(imageTemp, outputPath, imageDone && !result->canceled, result);
+    result->maskWritten = finishPartialFile(maskTemp, maskPath, maskDone && !result->canceled, result);
+    countSavedFile(options->stats, outputPath, result->imageWritten);
+    countSavedFile(options->stats, maskPath, result->maskWritten);
+    free(imageTemp);
+    free(maskTemp);
+
+    return checkFilesWritten(options, outputPath, maskPath, result);
+}
+
+// Reads and converts an image file; see convertImage(). PNGs that libpng can decode by itself are streamed a few rows
+// at a time, which keeps memory use flat no matter how big the image is. Everything else, and anything at all in
+// optimize mode (which needs the whole image), is read in full with readSourceImage() first. If the image can't be
+// read, result->sourceRead is false.
+bool convertImageFile(const char *inputPath, const Palette *pal, const ConvertOptions *options,
+                      const char *outputPath, const char *maskPath, ConvertResult *result)
+{
+    SourceImage img;
+
+    result->alphaType = ALPHA_NONE;
+    result->maskNeeded = false;
+    result->imageWritten = false;
+    result->maskWritten = false;
+    result->bytesSaved = 0;
+    result->sourceRead = false;
+    result->canceled = false;
+    result->error = NULL;
+
+    if (!options->optimize)
+    {
+        StreamStatus status = streamConvertPNG(inputPath, pal, options, outputPath, maskPath, result);
+        if (status == STREAM_READ_FAILED)
+        {
+            result->error = "failed to read image";
+            return false;
+        }
+        else if (status == STREAM_CANCELED || status == STREAM_DONE)
+        {
+            return checkFilesWritten(options, outputPath, maskPath, result);
+        }
+    }
+
+    if (!readSourceImageTimed(inputPath, &img, options->stats))
+    {
+        result->error = "failed to read image";
+        return false;
+    }
+    if (conversionCanceled(options->cancel))
+    {
+        // decoding can't be interrupted, but there's no need to encode anything afterwards
+        freeSourceImage(&img);
+        result->sourceRead = true;
+        result->canceled = true;
+        return checkFilesWritten(options, outputPath, maskPath, result);
+    }
+    bool ok = convertImage(&img, pal, options, outputPath, maskPath, result);
+    freeSourceImage(&img);
+    return ok;
+}
@@ -3,16 +3,125 @@
 #include <stdbool.h>
 #include "SDL.h"
 
+#define PALAPPLY_VERSION "2.0.3"
+
 typedef enum {
     ALPHA_NONE,        // alpha channel is all 255
     ALPHA_SIMPLE,      // alpha channel is all 0 or 255
     ALPHA_MASK_NEEDED, // alpha channel has values that are not 0 or 255
 } AlphaType;
 
-bool readPalette(const char *path);
-SDL_Surface *readSourceImage(const char *path);
-bool saveIndexedPNG(const char *path, SDL_Surface *screen);
-bool saveMask(const char* filename, SDL_Surface *screen);
+// None of these functions keep any global state, so any number of conversions can run at once on different threads,
+// with the same palette or with different ones. A Palette is never modified after readPalette() returns it.
+typedef struct Palette Palette;
+
+// How hard zlib and the PNG filter selection work on the output files. Only the file size and the time spent saving
+// depend on this; the decoded images are the same either way.
+typedef enum {
+    COMPRESSION_FAST,     // fastest to save, noticeably larger files
+    COMPRESSION_BALANCED, // zlib's default level
+    COMPRESSION_SMALLEST, // maximum compression
+} CompressionProfile;
+
+// How the distance between two colors is measured when looking for the nearest palette color. Only the choice of
+// palette entries depends on this.
+typedef enum {
+    COLOR_METRIC_RGB,          // squared distance in plain RGB, as palapply always did
+    COLOR_METRIC_WEIGHTED_RGB, // RGB with weights that follow the red level ("redmean"); nearly as fast as plain RGB
+    COLOR_METRIC_CIELAB,       // CIE76 delta E, the distance in CIELAB with a D65 white point
+    COLOR_METRIC_OKLAB,        // the distance in Oklab, which keeps hues and dark shades more even than CIELAB
+} ColorMetric;
+
+// Dithering spreads the difference between each source color and the palette color it gets over nearby pixels, so
+// that gradients come out as a mix of palette colors instead of bands. Transparent pixels still always map to index 0,
+// and nothing else in an image with an alpha channel does.
+typedef enum {
+    DITHER_NONE,            // plain nearest-color mapping
+    DITHER_ORDERED,         // an 8x8 Bayer threshold pattern; each pixel is independent, so it runs on every core
+    DITHER_FLOYD_STEINBERG, // error diffusion to the next pixel and three below; smooth, but one row at a time
+    DITHER_ATKINSON,        // error diffusion that only passes on 3/4 of the error; crisper, with more contrast
+} DitherMode;
+
+// The parts of a conversion that ConversionStats times.
+typedef enum {
+    STAGE_DECODE,   // reading and decompressing the source: IMG_Load(), or libpng when a PNG is streamed
+    STAGE_CONVERT,  // turning decoded pixels into RGBA rows and classifying the alpha channel
+    STAGE_QUANTIZE, // the nearest-color search
+    STAGE_ENCODE,   // PNG filtering and zlib compression of the output files
+    NUM_STAGES,
+} ConversionStage;
+
+// Where the time of a conversion went, and how much work it did. Conversions add to these values, so several can be
+// summed into one; start from zeroed stats. Collecting them costs a few timer reads per row.
+//
+// When an image is quantized in bands by helper threads, STAGE_QUANTIZE only counts the time spent waiting for the
+// helpers, since the rest of the search overlaps with the decoding and encoding.
+typedef struct {
+    Uint64 ticks[NUM_STAGES]; // wall time of each stage, in SDL_GetPerformanceFrequency() units
+    Uint64 pixelsQuantized;
+    Uint64 colorLookups;      // pixels that went through the nearest-color cache
+    Uint64 colorSearches;     // lookups that missed the cache and searched the palette
+    Uint64 rawBytes;          // uncompressed size of the rows passed to the PNG encoder
+    Uint64 bytesWritten;      // size of the files saved
+} ConversionStats;
+
+// Settings for a single conversion. Always start from defaultConvertOptions() so that new fields get sane defaults.
+//
+// Huge images and optimize mode start helper threads of their own. If spareThreads is NULL, they start one for every
+// other CPU, which is right for a conversion that has the machine to itself. Conversions that run alongside others
+// should share a count of idle CPUs through spareThreads instead: helpers are only started for CPUs taken from it,
+// and the CPUs are given back when the helpers are done, so that all of the conversions together don't start more
+// threads than there are CPUs. Whoever owns the count keeps it up to date as its own threads start and stop working.
+typedef struct {
+    bool writeImage; // save the indexed image
+    bool writeMask;  // save an alpha mask if the source needs one
+    CompressionProfile compression;
+    ColorMetric metric;
+    DitherMode dither;
+    bool optimize;       // try many encodings of each file and keep the smallest; much slower
+    bool reorderPalette; // in optimize mode, allow renumbering the palette by use (the colors stay the same)
+    SDL_atomic_t *cancel; // if not NULL, setting this to nonzero stops the conversion between rows; see convertImage()
+    SDL_atomic_t *spareThreads; // idle CPUs shared with other conversions, or NULL; see above
+    ConversionStats *stats; // if not NULL, the conversion's timings and counters are added to it
+} ConvertOptions;
+
+// A decoded source image. The alpha classification is worked out once when the image is read, so nothing after that
+// has to scan the pixels again just to find out whether a mask is needed.
+typedef struct {
+    SDL_Surface *surface; // in the format it was decoded to; Amask only says whether the file had an alpha channel
+    AlphaType alphaType;  // whether the image actually has any transparency; go by this rather than the surface
+} SourceImage;
+
+typedef struct {
+    AlphaType alphaType; // alpha classification of the source image
+    bool maskNeeded;     // the source has non-trivial alpha, so it needs a mask
+    bool imageWritten;
+    bool maskWritten;
+    long bytesSaved;     // in optimize mode, how much smaller the files came out than with the plain profile
+    bool sourceRead;     // false if the source image couldn't be read (convertImageFile() only)
+    bool canceled;       // stopped through options->cancel before all of the files were saved
+    const char *error;   // description of what went wrong if the conversion failed, otherwise NULL
+    char errorText[1024]; // where error is put together when it names a file
+} ConvertResult;
+
+Palette *readPalette(const char *path);
+void freePalette(Palette *pal);
+int paletteColors(const Palette *pal, SDL_Color colors[256]);
+bool readSourceImage(const char *path, SourceImage *image);
+bool readImageSize(const char *path, int *width, int *height);
+void freeSourceImage(SourceImage *image);
+void defaultConvertOptions(ConvertOptions *options);
+bool compressionProfileFromName(const char *name, CompressionProfile *profile);
+bool colorMetricFromName(const char *name, ColorMetric *metric);
+bool ditherModeFromName(const char *name, DitherMode *mode);
+bool convertImage(const SourceImage *img, const Palette *pal, const ConvertOptions *options,
+                  const char *outputPath, const char *maskPath, ConvertResult *result);
+bool convertImageFile(const char *inputPath, const Palette *pal, const ConvertOptions *options,
+                      const char *outputPath, const char *maskPath, ConvertResult *result);
+bool quantizeImage(const SourceImage *img, const Palette *pal, uint8_t *indices);
+bool saveIndices(const char *path, const uint8_t *indices, int width, int height, const Palette *pal);
+bool saveIndexedPNG(const char *path, const SourceImage *img, const Palette *pal);
+bool saveMask(const char* filename, const SourceImage *img);
 AlphaType alphaType(SDL_Surface *img);
 
 
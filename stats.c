@@ -0,0 +1,301 @@
+/*
+ * Copyright (c) 2018-2019 Bryan Cain
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Timing and counter statistics for a batch: a summary for the log, and per-file tables in JSON or CSV.
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <glib.h>
+#include "palapply.h"
+#include "batch.h"
+#include "stats.h"
+
+typedef struct {
+    gchar *inputPath;
+    bool ok;
+    gint64 elapsed; // microseconds
+    ConversionStats stats;
+} StatsRecord;
+
+struct StatsReport {
+    GArray *records;       // StatsRecord for each file that was converted, or at least started on
+    ConversionStats total;
+    gint64 totalElapsed;
+    unsigned int upToDateCount;
+    unsigned int failedCount;
+};
+
+static const char *const stageNames[NUM_STAGES] = { "decode", "convert", "quantize", "encode" };
+
+// Columns of the per-file tables, in order. Times are in milliseconds.
+enum {
+    FIELD_ELAPSED,
+    FIELD_STAGES, // one per stage from here on
+    FIELD_PIXELS = FIELD_STAGES + NUM_STAGES,
+    FIELD_LOOKUPS,
+    FIELD_SEARCHES,
+    FIELD_HIT_RATE,
+    FIELD_RAW_BYTES,
+    FIELD_BYTES_WRITTEN,
+    FIELD_RATIO,
+    NUM_FIELDS,
+};
+
+static const char *const fieldNames[NUM_FIELDS] = {
+    "elapsed_ms", "decode_ms", "convert_ms", "quantize_ms", "encode_ms", "pixels_quantized", "color_lookups",
+    "palette_searches", "cache_hit_rate", "raw_bytes", "bytes_written", "compression_ratio",
+};
+
+static double ticksToSeconds(Uint64 ticks)
+{
+    return (double) ticks / SDL_GetPerformanceFrequency();
+}
+
+static double cacheHitRate(const ConversionStats *stats)
+{
+    if (stats->colorLookups == 0) return 0;
+    return 1.0 - (double) stats->colorSearches / stats->colorLookups;
+}
+
+static double compressionRatio(const ConversionStats *stats)
+{
+    return stats->bytesWritten ? (double) stats->rawBytes / stats->bytesWritten : 0;
+}
+
+static void addStats(ConversionStats *total, const ConversionStats *stats)
+{
+    for (int stage = 0; stage < NUM_STAGES; stage++)
+    {
+        total->ticks[stage] += stats->ticks[stage];
+    }
+    total->pixelsQuantized += stats->pixelsQuantized;
+    total->colorLookups += stats->colorLookups;
+    total->colorSearches += stats->colorSearches;
+    total->rawBytes += stats->rawBytes;
+    total->bytesWritten += stats->bytesWritten;
+}
+
+StatsReport *statsReportNew(void)
+{
+    StatsReport *report = g_new0(StatsReport, 1);
+    report->records = g_array_new(FALSE, FALSE, sizeof(StatsRecord));
+    return report;
+}
+
+// Records a finished file. Pass it every message from batchPopMessage(); anything other than
+// BATCH_MESSAGE_FILE_DONE is ignored, as are jobs that were dropped before they started.
+void statsReportAdd(StatsReport *report, const BatchMessage *message)
+{
+    if (message->type != BATCH_MESSAGE_FILE_DONE)
+    {
+        return;
+    }
+    if (message->upToDate)
+    {
+        ++report->upToDateCount;
+        return;
+    }
+    if (message->stats == NULL)
+    {
+        return;
+    }
+
+    StatsRecord record;
+    record.inputPath = g_strdup(message->inputPath);
+    record.ok = message->ok;
+    record.elapsed = message->elapsed;
+    record.stats = *message->stats;
+    g_array_append_val(report->records, record);
+
+    addStats(&report->total, message->stats);
+    report->totalElapsed += message->elapsed;
+    if (!message->ok) ++report->failedCount;
+}
+
+// Returns a few lines of text saying where the time went, for the end of the log. Free it with g_free().
+gchar *statsReportSummary(const StatsReport *report)
+{
+    const ConversionStats *total = &report->total;
+    GString *text = g_string_new(NULL);
+    double stageSum = 0, quantizeSeconds = ticksToSeconds(total->ticks[STAGE_QUANTIZE]);
+    const StatsRecord *slowest = NULL;
+    int stage;
+
+    g_string_append_printf(text, "\nStatistics for %u converted files", report->records->len);
+    if (report->failedCount > 0) g_string_append_printf(text, " (%u failed)", report->failedCount);
+    if (report->upToDateCount > 0) g_string_append_printf(text, ", %u up to date", report->upToDateCount);
+    g_string_append(text, ":\n");
+
+    for (stage = 0; stage < NUM_STAGES; stage++)
+    {
+        stageSum += ticksToSeconds(total->ticks[stage]);
+    }
+    for (stage = 0; stage < NUM_STAGES; stage++)
+    {
+        double seconds = ticksToSeconds(total->ticks[stage]);
+        g_string_append_printf(text, "  %-10s %10.3f s %6.1f%%\n", stageNames[stage], seconds,
+                               stageSum > 0 ? 100 * seconds / stageSum : 0);
+    }
+
+    g_string_append_printf(text, "  pixels quantized: %" G_GUINT64_FORMAT, (guint64) total->pixelsQuantized);
+    if (quantizeSeconds > 0)
+    {
+        g_string_append_printf(text, " (%.1f million per second)", total->pixelsQuantized / quantizeSeconds / 1e6);
+    }
+    g_string_append_printf(text, "\n  color cache hits: %.1f%% of %" G_GUINT64_FORMAT " lookups\n",
+                           100 * cacheHitRate(total), (guint64) total->colorLookups);
+    g_string_append_printf(text, "  bytes written: %" G_GUINT64_FORMAT " (compressed %.1f:1)\n",
+                           (guint64) total->bytesWritten, compressionRatio(total));
+
+    for (guint i = 0; i < report->records->len; i++)
+    {
+        const StatsRecord *record = &g_array_index(report->records, StatsRecord, i);
+        if (slowest == NULL || record->elapsed > slowest->elapsed) slowest = record;
+    }
+    if (slowest)
+    {
+        g_string_append_printf(text, "  slowest file: %s (%.2f s)\n", slowest->inputPath, slowest->elapsed / 1e6);
+    }
+    g_string_append(text, "Stage times are added up over all threads, so they can come to more than the time the "
+                          "batch took.\n");
+
+    return g_string_free(text, FALSE);
+}
+
+// Formats the table columns for one file (or the total) in the C locale, whatever the UI's locale is.
+static void formatFields(const ConversionStats *stats, gint64 elapsed,
+                         gchar values[NUM_FIELDS][G_ASCII_DTOSTR_BUF_SIZE])
+{
+    g_ascii_formatd(values[FIELD_ELAPSED], G_ASCII_DTOSTR_BUF_SIZE, "%.3f", elapsed / 1e3);
+    for (int stage = 0; stage < NUM_STAGES; stage++)
+    {
+        g_ascii_formatd(values[FIELD_STAGES + stage], G_ASCII_DTOSTR_BUF_SIZE, "%.3f",
+                        ticksToSeconds(stats->ticks[stage]) * 1e3);
+    }
+    g_snprintf(values[FIELD_PIXELS], G_ASCII_DTOSTR_BUF_SIZE, "%" G_GUINT64_FORMAT, (guint64) stats->pixelsQuantized);
+    g_snprintf(values[FIELD_LOOKUPS], G_ASCII_DTOSTR_BUF_SIZE, "%" G_GUINT64_FORMAT, (guint64) stats->colorLookups);
+    g_snprintf(values[FIELD_SEARCHES], G_ASCII_DTOSTR_BUF_SIZE, "%" G_GUINT64_FORMAT, (guint64) stats->colorSearches);
+    g_ascii_formatd(values[FIELD_HIT_RATE], G_ASCII_DTOSTR_BUF_SIZE, "%.4f", cacheHitRate(stats));
+    g_snprintf(values[FIELD_RAW_BYTES], G_ASCII_DTOSTR_BUF_SIZE, "%" G_GUINT64_FORMAT, (guint64) stats->rawBytes);
+    g_snprintf(values[FIELD_BYTES_WRITTEN], G_ASCII_DTOSTR_BUF_SIZE, "%" G_GUINT64_FORMAT,
+               (guint64) stats->bytesWritten);
+    g_ascii_formatd(values[FIELD_RATIO], G_ASCII_DTOSTR_BUF_SIZE, "%.3f", compressionRatio(stats));
+}
+
+static void appendJsonString(GString *out, const gchar *text)
+{
+    g_string_append_c(out, '"');
+    for (const gchar *c = text; *c; c++)
+    {
+        if (*c == '"' || *c == '\\') g_string_append_printf(out, "\\%c", *c);
+        else if ((guchar) *c < 0x20) g_string_append_printf(out, "\\u%04x", (guchar) *c);
+        else g_string_append_c(out, *c);
+    }
+    g_string_append_c(out, '"');
+}
+
+static void appendJsonFields(GString *out, const ConversionStats *stats, gint64 elapsed)
+{
+    gchar values[NUM_FIELDS][G_ASCII_DTOSTR_BUF_SIZE];
+    formatFields(stats, elapsed, values);
+    for (int field = 0; field < NUM_FIELDS; field++)
+    {
+        g_string_append_printf(out, ", \"%s\": %s", fieldNames[field], values[field]);
+    }
+}
+
+static gchar *reportToJson(const StatsReport *report)
+{
+    GString *out = g_string_new("{\n  \"files\": [\n");
+
+    for (guint i = 0; i < report->records->len; i++)
+    {
+        const StatsRecord *record = &g_array_index(report->records, StatsRecord, i);
+        g_string_append(out, "    {\"input\": ");
+        appendJsonString(out, record->inputPath);
+        g_string_append_printf(out, ", \"ok\": %s", record->ok ? "true" : "false");
+        appendJsonFields(out, &record->stats, record->elapsed);
+        g_string_append(out, i + 1 < report->records->len ? "},\n" : "}\n");
+    }
+
+    g_string_append_printf(out, "  ],\n  \"total\": {\"files\": %u, \"failed\": %u, \"up_to_date\": %u",
+                           report->records->len, report->failedCount, report->upToDateCount);
+    appendJsonFields(out, &report->total, report->totalElapsed);
+    g_string_append(out, "}\n}\n");
+    return g_string_free(out, FALSE);
+}
+
+static void appendCsvString(GString *out, const gchar *text)
+{
+    g_string_append_c(out, '"');
+    for (const gchar *c = text; *c; c++)
+    {
+        if (*c == '"') g_string_append_c(out, '"');
+        g_string_append_c(out, *c);
+    }
+    g_string_append_c(out, '"');
+}
+
+static gchar *reportToCsv(const StatsReport *report)
+{
+    GString *out = g_string_new("input,ok");
+    gchar values[NUM_FIELDS][G_ASCII_DTOSTR_BUF_SIZE];
+    int field;
+
+    for (field = 0; field < NUM_FIELDS; field++)
+    {
+        g_string_append_printf(out, ",%s", fieldNames[field]);
+    }
+    g_string_append(out, "\r\n");
+
+    for (guint i = 0; i < report->records->len; i++)
+    {
+        const StatsRecord *record = &g_array_index(report->records, StatsRecord, i);
+        appendCsvString(out, record->inputPath);
+        g_string_append(out, record->ok ? ",1" : ",0");
+        formatFields(&record->stats, record->elapsed, values);
+        for (field = 0; field < NUM_FIELDS; field++)
+        {
+            g_string_append_printf(out, ",%s", values[field]);
+        }
+        g_string_append(out, "\r\n");
+    }
+    return g_string_free(out, FALSE);
+}
+
+// Saves the figures for each file, as CSV if path ends in ".csv" and as JSON otherwise. Returns false on failure.
+bool statsReportSave(const StatsReport *report, const gchar *path)
+{
+    gchar *lowercasePath = g_ascii_strdown(path, -1);
+    gchar *contents = g_str_has_suffix(lowercasePath, ".csv") ? reportToCsv(report) : reportToJson(report);
+    bool ok = g_file_set_contents(path, contents, -1, NULL);
+
+    g_free(contents);
+    g_free(lowercasePath);
+    return ok;
+}
+
+void statsReportFree(StatsReport *report)
+{
+    for (guint i = 0; i < report->records->len; i++)
+    {
+        g_free(g_array_index(report->records, StatsRecord, i).inputPath);
+    }
+    g_array_free(report->records, TRUE);
+    g_free(report);
+}
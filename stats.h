@@ -0,0 +1,17 @@
+#pragma once
+
+#include <stdbool.h>
+#include <glib.h>
+#include "palapply.h"
+#include "batch.h"
+
+// Adds up the ConversionStats of the files in a batch (see batchCollectStats()), for a summary of where the time
+// went at the end and a table of the figures for each file. Only for use on the thread that owns the batch.
+
+typedef struct StatsReport StatsReport;
+
+StatsReport *statsReportNew(void);
+void statsReportAdd(StatsReport *report, const BatchMessage *message);
+gchar *statsReportSummary(const StatsReport *report);
+bool statsReportSave(const StatsReport *report, const gchar *path);
+void statsReportFree(StatsReport *report);
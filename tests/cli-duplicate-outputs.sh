@@ -0,0 +1,63 @@
+#!/bin/sh
+# Checks that a batch never runs two conversions into the same output file, which would have them both write the same
+# temporary file at once. Inputs are named by their base name in the output directory, so a/x.png and b/x.png clash,
+# as does one file given twice, directly or through a wildcard. The first of each is converted and the rest fail.
+#
+# Usage: tests/cli-duplicate-outputs.sh path/to/palapply-v2
+
+if [ $# -ne 1 ]; then
+    echo "usage: $0 path/to/palapply-v2" >&2
+    exit 2
+fi
+palapply=$1
+
+dir=$(mktemp -d) || exit 2
+trap 'rm -rf "$dir"' EXIT
+failures=0
+
+fail()
+{
+    echo "FAIL: $1" >&2
+    failures=$((failures + 1))
+}
+
+# 1x1 opaque red and blue PNGs, and a palette with red at index 1 and blue at index 2
+mkdir "$dir/a" "$dir/b"
+echo "iVBORw0KGgoAAAANSUhEUgAAAAEAAAABCAYAAAAfFcSJAAAADUlEQVR4nGP4z8DwHwAFAAH/iZk9HQAAAABJRU5ErkJggg==" |
+    base64 -d > "$dir/a/x.png"
+echo "iVBORw0KGgoAAAANSUhEUgAAAAEAAAABCAYAAAAfFcSJAAAADUlEQVR4nGNgYPj/HwADAgH/5ncLrgAAAABJRU5ErkJggg==" |
+    base64 -d > "$dir/b/x.png"
+{ printf '\000\000\000\377\000\000\000\000\377'; head -c 759 /dev/zero; } > "$dir/palette.act"
+
+# runs a batch into a fresh output directory and checks that exactly one of its two inputs failed
+expect_one_failure()
+{
+    name=$1
+    shift
+    rm -rf "$dir/out"
+    mkdir "$dir/out"
+    if "$palapply" --batch -j 2 "$dir/palette.act" "$dir/out" "$@" > "$dir/stdout" 2> "$dir/stderr"; then
+        fail "$name: the batch succeeded"
+    fi
+    grep -q "1 of 2 files failed" "$dir/stderr" || fail "$name: expected exactly one of the two inputs to fail"
+    grep -q "same output file as" "$dir/stderr" || fail "$name: the failure doesn't mention the clash"
+    [ -s "$dir/out/x.png" ] || fail "$name: out/x.png wasn't written"
+    ls "$dir/out" | grep -q "\.part$" && fail "$name: a .part file was left behind"
+}
+
+expect_one_failure "same base name" "$dir/a/x.png" "$dir/b/x.png"
+expect_one_failure "same file twice" "$dir/a/x.png" "$dir/a/x.png"
+expect_one_failure "file and wildcard" "$dir/a/x.png" "$dir/a/*.png"
+
+# the first of the clashing inputs is the one converted, so out/x.png is red
+"$palapply" --batch "$dir/palette.act" "$dir/out" "$dir/b/x.png" > /dev/null 2>&1
+blue=$(cksum < "$dir/out/x.png")
+rm -rf "$dir/out"
+mkdir "$dir/out"
+"$palapply" --batch "$dir/palette.act" "$dir/out" "$dir/a/x.png" "$dir/b/x.png" > /dev/null 2>&1
+[ "$(cksum < "$dir/out/x.png")" != "$blue" ] || fail "the second input replaced the first one's output"
+
+if [ $failures -ne 0 ]; then
+    exit 1
+fi
+echo "PASS"